@@ -6,9 +6,12 @@ import sys
 import time
 import smbus
 import struct
+import json
+import threading
 from typing import Tuple, Any
 from configparser import ConfigParser
 from argparse import ArgumentParser, Namespace
+from collections import defaultdict
 from collections.abc import Mapping
 from pathlib import Path
 from attiny_i2c import ATTiny
@@ -18,8 +21,8 @@ from attiny_i2c import ATTiny
 
 # Version information
 major = 2
-minor = 9
-patch = 4
+minor = 10
+patch = 0
 
 # config file is in the same directory as the script:
 _configfile_default = str(Path(__file__).parent.absolute()) + "/attiny_daemon.cfg"
@@ -27,16 +30,18 @@ _shutdown_cmd = "sudo systemctl poweroff"  # sudo allows us to start as user 'pi
 _reboot_cmd = "sudo systemctl reboot"      # sudo allows us to start as user 'pi'
 _time_const = 0.5  # used as a pause between i2c communications, the ATTiny is slow
 _num_retries = 10  # the number of retries when reading from or writing to the ATTiny
+_link_log_interval = 3600  # seconds between two logs of the I2C link counters
 
 # These are the different values reported back by the ATTiny depending on its config
 button_level = 2**3
+power_level = 2**2
 SL_INITIATED = 2  # the value we use to signal that we are shutting down
 shutdown_levels = {
     # 0: Normal mode
     0: "Everything is normal.",
     # 2 is reserved for us signalling the ATTiny that we are shutting down
     # 4-15: Maybe shutdown or restart, depending on configuration
-    2**2: "No external voltage detected. We are on battery power.",
+    power_level: "No external voltage detected. We are on battery power.",
     button_level: "Button has been pressed. Reacting according to configuration.",
     # >16: Definitely shut down
     2**7: "Battery is at warn level. Shutting down.",
@@ -47,6 +52,16 @@ button_functions = {
     "shutdown": lambda: os.system(_shutdown_cmd),
     "reboot": lambda: os.system(_reboot_cmd)
 }
+# Here we store the functions called when the battery of a unit reaches the warn level.
+# A unit that does not power the Raspberry itself can be configured to do nothing.
+def shutdown_now():
+    logging.info("shutting down now...")
+    os.system(_shutdown_cmd)
+
+warn_functions = {
+    "nothing": lambda: logging.info("Battery at warn level. Configured to do nothing."),
+    "shutdown": shutdown_now
+}
 
 # this is the minimum reboot time we assume the RPi needs, used for a warning message
 minimum_boot_time = 30
@@ -54,7 +69,23 @@ minimum_boot_time = 30
 ### Code starts here.
 ### Here be dragons...
 
-bus = smbus.SMBus(1)
+class LockedBus:
+    # The units are polled by their own threads. The lock keeps the transfers of
+    # different units apart, the pauses between the transfers are not locked.
+    def __init__(self, bus):
+        self._bus = bus
+        self._lock = threading.Lock()
+
+    def __getattr__(self, name):
+        method = getattr(self._bus, name)
+
+        def locked(*args, **kwargs):
+            with self._lock:
+                return method(*args, **kwargs)
+        return locked
+
+
+bus = LockedBus(smbus.SMBus(1))
 
 
 def main(*args):
@@ -63,72 +94,157 @@ def main(*args):
     args = parse_cmdline(args)
     setup_logger(args.nodaemon)
 
-    config = Config(args.cfgfile)
-    config.read_config()
+    sections = Config.unit_sections(args.cfgfile)
+    configs = [Config(args.cfgfile, section) for section in sections]
+    for config in configs:
+        config.read_config()
 
     logging.info("ATTiny Daemon version " + str(major) + "." + str(minor) + "." + str(patch))
 
-    attiny = ATTiny(bus, config[Config.I2C_ADDRESS], _time_const, _num_retries)
-
-    if attiny.get_last_access() < 0:
-        logging.error("Cannot access ATTiny")
-        log_geekworm_voltage()
+    addresses = [config[Config.I2C_ADDRESS] for config in configs]
+    if len(set(addresses)) != len(addresses):
+        logging.error("Several units use the same I2C address. Check the config file.")
         exit(1)
-
-    (a_major, a_minor, a_patch) = attiny.get_version()
-    logging.info("ATTiny firmware version " + str(a_major) + "." + str(a_minor) + "." + str(a_patch))
-
-    if major != a_major:
-        logging.error("Daemon and Firmware major version mismatch. This might lead to serious problems. Check both versions.")
-
-    config.merge_and_sync_values(attiny)
-
-    # loop until stopped or error
-    set_unprimed = False
+    if len(configs) > 1:
+        # tell the units apart in the log
+        for handler in logging.getLogger().handlers:
+            handler.setFormatter(logging.Formatter("%(threadName)s: %(message)s"))
+
+    listener = HostNotifyListener()
+    if any(config[Config.NOTIFY] for config in configs) and not listener.start():
+        logging.warning("Cannot receive Host Notify messages, falling back to polling.")
+        for config in configs:
+            config.disable_notify()
+
+    units = [Unit(config, listener, args.nodaemon) for config in configs]
+    for unit in units:
+        unit.start()
+
+    # wait until all units are stopped, could not be accessed or have lost their connection
     try:
-        while True:
-            should_shutdown = attiny.should_shutdown()
-            if should_shutdown == 0xFFFF:
-                # We have a big problem
-                logging.error("Lost connection to ATTiny.")
-                log_geekworm_voltage()
-                set_unprimed = True        # we still try to reset primed
-                exit(1)  # executes finally clause and lets the system restart the daemon
-
-            if should_shutdown > SL_INITIATED:
-                # we will not exit the process but wait for the systemd to shut us down
-                # using SIGTERM. This does not execute the finally clause and leaves
-                # everything as it is currently configured
-                global shutdown_levels
-                fallback = "Unknown shutdown_level " + str(should_shutdown) + ". Shutting down."
-                logging.warning(shutdown_levels.get(should_shutdown, fallback))
-
-                if should_shutdown > 16:
-                    attiny.set_should_shutdown(SL_INITIATED) # we are shutting down
-                    logging.info("shutting down now...")
-                    os.system(_shutdown_cmd)
-                elif (should_shutdown | button_level) != 0:
-                    # we are executing the button command and setting the level to normal
-                    attiny.set_should_shutdown(0)
-                    button_functions[config[Config.BUTTON_FUNCTION]]()
-
-            logging.debug("Sleeping for " + str(config[Config.SLEEPTIME]) + " seconds.")
-            time.sleep(config[Config.SLEEPTIME])
-
+        while any(unit.is_alive() for unit in units):
+            time.sleep(1)   # join() would not let us see a KeyboardInterrupt
     except KeyboardInterrupt:
         logging.info("Terminating daemon: cleaning up and exiting")
         # Ctrl-C means we do not run as daemon
-        set_unprimed = True
-    except Exception as e:
-        logging.error("An exception occurred: '" + str(e) + "' Exiting...")
-    finally:
-        # will not be executed on SIGTERM, leaving primed set to the config value
-        primed = config[Config.PRIMED]
-        if args.nodaemon or set_unprimed:
-            primed = False
-        if primed == False:
-            logging.info("Trying to reset primed flag")
-        attiny.set_primed(primed)
+        for unit in units:
+            unit.stop()
+        listener.wake()
+        for unit in units:
+            unit.join()
+        listener.stop()
+        return
+    listener.stop()
+    exit(1)  # lets the system restart the daemon
+
+
+class Unit(threading.Thread):
+    # One ATTiny with its own config section. Each unit is polled by its own thread
+    # and reacts to its own should_shutdown according to its configuration.
+    def __init__(self, config, listener, nodaemon):
+        super().__init__(name=config.name, daemon=True)
+        self._config = config
+        self._listener = listener
+        self._nodaemon = nodaemon
+        self._stopped = False
+        self._attiny = ATTiny(bus, config[Config.I2C_ADDRESS], _time_const, _num_retries)
+
+    def setup(self):
+        # check the connection and sync the values, returns False if the ATTiny cannot be accessed
+        attiny = self._attiny
+        if attiny.get_last_access() < 0:
+            logging.error("Cannot access ATTiny at " + hex(self._config[Config.I2C_ADDRESS]))
+            log_geekworm_voltage()
+            return False
+
+        (a_major, a_minor, a_patch) = attiny.get_version()
+        logging.info("ATTiny firmware version " + str(a_major) + "." + str(a_minor) + "." + str(a_patch))
+
+        if major != a_major:
+            logging.error("Daemon and Firmware major version mismatch. This might lead to serious problems. Check both versions.")
+        elif minor != a_minor:
+            logging.warning("Daemon and Firmware minor version mismatch. Features only one of them knows are not used. Check both versions.")
+
+        # the firmware tells us which registers and features it supports
+        if attiny.discover():
+            logging.info("ATTiny firmware describes " + str(len(attiny.registers())) + " registers")
+        else:
+            logging.info("ATTiny firmware does not describe its registers, using the built-in register list")
+
+        self._config.merge_and_sync_values(attiny)
+        return True
+
+    def stop(self):
+        # called on Ctrl-C, the unit resets primed and ends its loop
+        self._stopped = True
+
+    def run(self):
+        attiny = self._attiny
+        config = self._config
+        if not self.setup():
+            return
+        log_link_counters(attiny)
+        log_battery_health(attiny)
+        last_link_log = time.monotonic()
+
+        # loop until stopped or error
+        set_unprimed = False
+        power_events = None
+        try:
+            while not self._stopped:
+                if time.monotonic() - last_link_log >= _link_log_interval:
+                    log_link_counters(attiny)
+                    log_battery_health(attiny)
+                    last_link_log = time.monotonic()
+
+                should_shutdown = attiny.should_shutdown()
+                if should_shutdown == 0xFFFF:
+                    # We have a big problem
+                    logging.error("Lost connection to ATTiny.")
+                    log_geekworm_voltage()
+                    set_unprimed = True        # we still try to reset primed
+                    return  # executes finally clause, the daemon is restarted when all units are gone
+
+                causes = should_shutdown
+                if attiny.has_feature(attiny.FEATURE_POWER_EVENTS):
+                    # the firmware latches every change of the external voltage, we log each
+                    # once instead of the persisting level
+                    power_events = log_power_event(attiny, power_events)
+                    causes &= ~power_level
+
+                if causes > SL_INITIATED:
+                    # we will not exit the process but wait for the systemd to shut us down
+                    # using SIGTERM. This does not execute the finally clause and leaves
+                    # everything as it is currently configured
+                    log_shutdown_causes(causes)
+
+                    if causes > 16:
+                        attiny.set_should_shutdown(SL_INITIATED) # we are shutting down
+                        if attiny.has_register(attiny.REG_TIME_TO_SHUTDOWN):
+                            log_time_left(attiny.get_time_to_shutdown(), "the shutdown voltage")
+                        warn_functions[config[Config.WARN_FUNCTION]]()
+                    elif (causes & button_level) != 0:
+                        # we are executing the button command and clearing the button level,
+                        # a loss of the external voltage stays signalled
+                        attiny.set_should_shutdown(should_shutdown & ~button_level)
+                        button_functions[config[Config.BUTTON_FUNCTION]]()
+
+                logging.debug("Sleeping for " + str(config[Config.SLEEPTIME]) + " seconds.")
+                if self._listener.wait(config[Config.SLEEPTIME]):
+                    logging.debug("Woken by Host Notify")
+
+            # Ctrl-C means we do not run as daemon
+            set_unprimed = True
+        except Exception as e:
+            logging.error("An exception occurred: '" + str(e) + "' Exiting...")
+        finally:
+            # will not be executed on SIGTERM, leaving primed set to the config value
+            primed = config[Config.PRIMED]
+            if self._nodaemon or set_unprimed:
+                primed = False
+            if primed == False:
+                logging.info("Trying to reset primed flag")
+            attiny.set_primed(primed)
 
 
 def parse_cmdline(args: Tuple[Any]) -> Namespace:
@@ -197,6 +313,18 @@ class Config(Mapping):
     RESET_CONFIG = 'reset configuration'
     RESET_PULSE_LENGTH = 'reset pulse length'
     SW_RECOVERY_DELAY = 'switch recovery delay'
+    NOTIFY = 'host notify'
+    WARN_FUNCTION = 'warn function'
+    OVERSAMPLING = 'oversampling'
+    BAT_PROCESS_NOISE = 'battery process noise'
+    BAT_MEASURE_NOISE = 'battery measurement noise'
+    T_ALPHA = 'temperature alpha'
+    SAMPLING_PROFILE = 'sampling profile'
+
+    # Several units are configured with one section each, their options override
+    # the options of the daemon section. Without unit sections the daemon section
+    # describes the only unit.
+    UNIT_PREFIX = "unit "
 
     MAX_INT = sys.maxsize
     DEFAULT_CONFIG = {
@@ -220,16 +348,25 @@ class Config(Mapping):
             RESET_CONFIG: "0",
             RESET_PULSE_LENGTH: "200",
             SW_RECOVERY_DELAY: "1000",
+            NOTIFY: 'False',
+            WARN_FUNCTION: "shutdown",
+            OVERSAMPLING: str(MAX_INT),
+            BAT_PROCESS_NOISE: str(MAX_INT),
+            BAT_MEASURE_NOISE: str(MAX_INT),
+            T_ALPHA: str(MAX_INT),
+            SAMPLING_PROFILE: str(MAX_INT),
             LOG_LEVEL: 'DEBUG'
         }
     }
 
-    def __init__(self, cfgfile):
+    def __init__(self, cfgfile, section=DAEMON_SECTION):
         global _configfile_default  # simpler to change than a class variable
         if cfgfile:
             self.configfile_name = cfgfile
         else:
             self.configfile_name = _configfile_default
+        self.section = section
+        self.name = section[len(self.UNIT_PREFIX):] if section.startswith(self.UNIT_PREFIX) else "attiny"
         self.config = {}
         self.parser = ConfigParser(allow_no_value=True)
         self._storage = dict()
@@ -243,6 +380,22 @@ class Config(Mapping):
     def __len__(self):
         return len(self._storage)
 
+    @classmethod
+    def unit_sections(cls, cfgfile):
+        parser = ConfigParser(allow_no_value=True)
+        try:
+            parser.read(cfgfile if cfgfile else _configfile_default)
+        except Exception:
+            pass  # read_config() tells about it
+        sections = [section for section in parser.sections() if section.startswith(cls.UNIT_PREFIX)]
+        return sections if sections else [cls.DAEMON_SECTION]
+
+    def _section_of(self, option):
+        # options of a unit section override the options of the daemon section
+        if self.parser.has_option(self.section, option):
+            return self.section
+        return self.DAEMON_SECTION
+
     def read_config(self):
         self.parser.read_dict(self.DEFAULT_CONFIG)
 
@@ -255,37 +408,80 @@ class Config(Mapping):
                 self.parser.read(self.configfile_name)
             except Exception:
                 logging.warning("cannot read config file. Using default values")
+        if not self.parser.has_section(self.section):
+            self.parser.add_section(self.section)
 
         try:
-            self._storage[self.I2C_ADDRESS] = int(self.parser.get(self.DAEMON_SECTION, self.I2C_ADDRESS), 0)
-            self._storage[self.TIMEOUT] = self.parser.getint(self.DAEMON_SECTION, self.TIMEOUT)
-            self._storage[self.SLEEPTIME] = self.parser.getint(self.DAEMON_SECTION, self.SLEEPTIME)
-            self._storage[self.PRIMED] = self.parser.getboolean(self.DAEMON_SECTION, self.PRIMED)
-            self._storage[self.BAT_V_COEFFICIENT] = self.parser.getint(self.DAEMON_SECTION, self.BAT_V_COEFFICIENT)
-            self._storage[self.BAT_V_CONSTANT] = self.parser.getint(self.DAEMON_SECTION, self.BAT_V_CONSTANT)
-            self._storage[self.EXT_V_COEFFICIENT] = self.parser.getint(self.DAEMON_SECTION, self.EXT_V_COEFFICIENT)
-            self._storage[self.EXT_V_CONSTANT] = self.parser.getint(self.DAEMON_SECTION, self.EXT_V_CONSTANT)
-            self._storage[self.T_COEFFICIENT] = self.parser.getint(self.DAEMON_SECTION, self.T_COEFFICIENT)
-            self._storage[self.T_CONSTANT] = self.parser.getint(self.DAEMON_SECTION, self.T_CONSTANT)
-            self._storage[self.FORCE_SHUTDOWN] = self.parser.getboolean(self.DAEMON_SECTION, self.FORCE_SHUTDOWN)
-            self._storage[self.LED_OFF_MODE] = self.parser.getboolean(self.DAEMON_SECTION, self.LED_OFF_MODE)
-            self._storage[self.WARN_VOLTAGE] = self.parser.getint(self.DAEMON_SECTION, self.WARN_VOLTAGE)
-            self._storage[self.SHUTDOWN_VOLTAGE] = self.parser.getint(self.DAEMON_SECTION, self.SHUTDOWN_VOLTAGE)
-            self._storage[self.RESTART_VOLTAGE] = self.parser.getint(self.DAEMON_SECTION, self.RESTART_VOLTAGE)
-            self._storage[self.BUTTON_FUNCTION] = self.parser.get(self.DAEMON_SECTION, self.BUTTON_FUNCTION)
-            self._storage[self.RESET_CONFIG] = self.parser.getint(self.DAEMON_SECTION, self.RESET_CONFIG)
-            self._storage[self.RESET_PULSE_LENGTH] = self.parser.getint(self.DAEMON_SECTION, self.RESET_PULSE_LENGTH)
-            self._storage[self.SW_RECOVERY_DELAY] = self.parser.getint(self.DAEMON_SECTION, self.SW_RECOVERY_DELAY)
-            logging.getLogger().setLevel(self.parser.get(self.DAEMON_SECTION, self.LOG_LEVEL))
+            self._storage[self.I2C_ADDRESS] = int(self.parser.get(self._section_of(self.I2C_ADDRESS), self.I2C_ADDRESS), 0)
+            self._storage[self.TIMEOUT] = self.parser.getint(self._section_of(self.TIMEOUT), self.TIMEOUT)
+            self._storage[self.SLEEPTIME] = self.parser.getint(self._section_of(self.SLEEPTIME), self.SLEEPTIME)
+            self._storage[self.PRIMED] = self.parser.getboolean(self._section_of(self.PRIMED), self.PRIMED)
+            self._storage[self.BAT_V_COEFFICIENT] = self.parser.getint(self._section_of(self.BAT_V_COEFFICIENT), self.BAT_V_COEFFICIENT)
+            self._storage[self.BAT_V_CONSTANT] = self.parser.getint(self._section_of(self.BAT_V_CONSTANT), self.BAT_V_CONSTANT)
+            self._storage[self.EXT_V_COEFFICIENT] = self.parser.getint(self._section_of(self.EXT_V_COEFFICIENT), self.EXT_V_COEFFICIENT)
+            self._storage[self.EXT_V_CONSTANT] = self.parser.getint(self._section_of(self.EXT_V_CONSTANT), self.EXT_V_CONSTANT)
+            self._storage[self.T_COEFFICIENT] = self.parser.getint(self._section_of(self.T_COEFFICIENT), self.T_COEFFICIENT)
+            self._storage[self.T_CONSTANT] = self.parser.getint(self._section_of(self.T_CONSTANT), self.T_CONSTANT)
+            self._storage[self.FORCE_SHUTDOWN] = self.parser.getboolean(self._section_of(self.FORCE_SHUTDOWN), self.FORCE_SHUTDOWN)
+            self._storage[self.LED_OFF_MODE] = self.parser.getboolean(self._section_of(self.LED_OFF_MODE), self.LED_OFF_MODE)
+            self._storage[self.WARN_VOLTAGE] = self.parser.getint(self._section_of(self.WARN_VOLTAGE), self.WARN_VOLTAGE)
+            self._storage[self.SHUTDOWN_VOLTAGE] = self.parser.getint(self._section_of(self.SHUTDOWN_VOLTAGE), self.SHUTDOWN_VOLTAGE)
+            self._storage[self.RESTART_VOLTAGE] = self.parser.getint(self._section_of(self.RESTART_VOLTAGE), self.RESTART_VOLTAGE)
+            self._storage[self.BUTTON_FUNCTION] = self.parser.get(self._section_of(self.BUTTON_FUNCTION), self.BUTTON_FUNCTION)
+            self._storage[self.RESET_CONFIG] = self.parser.getint(self._section_of(self.RESET_CONFIG), self.RESET_CONFIG)
+            self._storage[self.RESET_PULSE_LENGTH] = self.parser.getint(self._section_of(self.RESET_PULSE_LENGTH), self.RESET_PULSE_LENGTH)
+            self._storage[self.SW_RECOVERY_DELAY] = self.parser.getint(self._section_of(self.SW_RECOVERY_DELAY), self.SW_RECOVERY_DELAY)
+            self._storage[self.NOTIFY] = self.parser.getboolean(self._section_of(self.NOTIFY), self.NOTIFY)
+            self._storage[self.WARN_FUNCTION] = self.parser.get(self._section_of(self.WARN_FUNCTION), self.WARN_FUNCTION)
+            self._storage[self.OVERSAMPLING] = int(self.parser.get(self._section_of(self.OVERSAMPLING), self.OVERSAMPLING), 0)
+            self._storage[self.BAT_PROCESS_NOISE] = self.parser.getint(self._section_of(self.BAT_PROCESS_NOISE), self.BAT_PROCESS_NOISE)
+            self._storage[self.BAT_MEASURE_NOISE] = self.parser.getint(self._section_of(self.BAT_MEASURE_NOISE), self.BAT_MEASURE_NOISE)
+            self._storage[self.T_ALPHA] = self.parser.getint(self._section_of(self.T_ALPHA), self.T_ALPHA)
+            self._storage[self.SAMPLING_PROFILE] = self.parser.getint(self._section_of(self.SAMPLING_PROFILE), self.SAMPLING_PROFILE)
+            logging.getLogger().setLevel(self.parser.get(self._section_of(self.LOG_LEVEL), self.LOG_LEVEL))
             logging.debug("config variables are set")
         except Exception as e:
             logging.error("Cannot convert option: " + str(e))
             exit(1)
 
+    def disable_notify(self):
+        # the ATTiny should not send Host Notify messages if nobody listens,
+        # the config file is not changed
+        self._storage[self.NOTIFY] = False
+
+    def cache_file_name(self):
+        # the register cache is kept next to the config file, one for each unit
+        base = os.path.splitext(self.configfile_name)[0]
+        if self.section == self.DAEMON_SECTION:
+            return base + ".cache"
+        return base + "." + self.name + ".cache"
+
+    def read_cache(self):
+        # the register values read by the last run, the ATTiny tells us which
+        # of them changed since then
+        try:
+            with open(self.cache_file_name(), 'r') as cachefile:
+                return {int(reg): value for (reg, value) in json.load(cachefile).items()}
+        except Exception:
+            logging.debug("No usable register cache, reading all registers")
+            return dict()
+
+    def write_cache(self, values):
+        try:
+            with open(self.cache_file_name(), 'w') as cachefile:
+                json.dump(values, cachefile)
+        except Exception:
+            logging.warning("cannot write register cache.")
+
     def write_config(self):
         try:
+            # other units might have written the file since we read it, we only
+            # replace our own section
+            parser = ConfigParser(allow_no_value=True)
+            parser.read(self.configfile_name)
+            parser.read_dict({self.section: dict(self.parser.items(self.section))})
             cfgfile = open(self.configfile_name, 'w')
-            self.parser.write(cfgfile)
+            parser.write(cfgfile)
             cfgfile.close()
         except Exception:
             logging.warning("cannot write config file.")
@@ -307,14 +503,26 @@ class Config(Mapping):
         logging.debug("Merge Values and save if necessary")
         changed_config = False
 
-        attiny_primed = attiny.get_primed()
-        attiny_timeout = attiny.get_timeout()
-        attiny_force_shutdown = attiny.get_force_shutdown()
-        attiny_led_off_mode = attiny.get_led_off_mode()
-        attiny_reset_configuration = attiny.get_reset_configuration()
-        attiny_reset_pulse_length = attiny.get_reset_pulse_length()
-        attiny_switch_recovery_delay = attiny.get_switch_recovery_delay()
-
+        # only the registers that changed since the last run are read from the ATTiny,
+        # the others are taken from the cache. Registers that cannot be read are
+        # reported with the same error value as the single register reads.
+        values = self.read_cache()
+        if not attiny.update_values(values):
+            logging.warning("Couldn't read all registers from the ATTiny")
+        registers = defaultdict(lambda: 0xFFFFFFFF, values)
+
+        attiny_primed = registers[attiny.REG_PRIMED]
+        attiny_timeout = registers[attiny.REG_TIMEOUT]
+        attiny_force_shutdown = registers[attiny.REG_FORCE_SHUTDOWN]
+        attiny_led_off_mode = registers[attiny.REG_LED_OFF_MODE]
+        attiny_reset_configuration = registers[attiny.REG_RESET_CONFIG]
+        attiny_reset_pulse_length = registers[attiny.REG_RESET_PULSE_LENGTH]
+        attiny_switch_recovery_delay = registers[attiny.REG_SW_RECOVERY_DELAY]
+        attiny_notify = registers[attiny.REG_NOTIFY]
+
+        # the values that differ are collected and written with batch writes
+        writes = []
+        threshold_writes = []
 
         if self._storage[self.TIMEOUT] == self.MAX_INT:
             # timeout was not set in the config file
@@ -330,100 +538,249 @@ class Config(Mapping):
             self._storage[self.RESET_PULSE_LENGTH] = attiny_reset_pulse_length
             self._storage[self.SW_RECOVERY_DELAY] = attiny_switch_recovery_delay
 
-            self.parser.set(self.DAEMON_SECTION, self.TIMEOUT,
+            self.parser.set(self.section, self.TIMEOUT,
                             str(self._storage[self.TIMEOUT]))
-            self.parser.set(self.DAEMON_SECTION, self.PRIMED,
+            self.parser.set(self.section, self.PRIMED,
                             str(self._storage[self.PRIMED]))
-            self.parser.set(self.DAEMON_SECTION, self.FORCE_SHUTDOWN,
+            self.parser.set(self.section, self.FORCE_SHUTDOWN,
                             str(self._storage[self.FORCE_SHUTDOWN]))
-            self.parser.set(self.DAEMON_SECTION, self.LED_OFF_MODE,
+            self.parser.set(self.section, self.LED_OFF_MODE,
                             str(self._storage[self.LED_OFF_MODE]))
-            self.parser.set(self.DAEMON_SECTION, self.RESET_CONFIG,
+            self.parser.set(self.section, self.RESET_CONFIG,
                             str(self._storage[self.RESET_CONFIG]))
-            self.parser.set(self.DAEMON_SECTION, self.RESET_PULSE_LENGTH,
+            self.parser.set(self.section, self.RESET_PULSE_LENGTH,
                             str(self._storage[self.RESET_PULSE_LENGTH]))
-            self.parser.set(self.DAEMON_SECTION, self.SW_RECOVERY_DELAY,
+            self.parser.set(self.section, self.SW_RECOVERY_DELAY,
                             str(self._storage[self.SW_RECOVERY_DELAY]))
             changed_config = True
         else:
             if attiny_timeout != self._storage[self.TIMEOUT]:
                 logging.debug("Writing Timeout to ATTiny")
-                attiny.set_timeout(self._storage[self.TIMEOUT])
+                writes.append((attiny.REG_TIMEOUT, self._storage[self.TIMEOUT]))
             if attiny_primed != self._storage[self.PRIMED]:
                 logging.debug("Writing Primed to ATTiny")
-                attiny.set_primed(self._storage[self.PRIMED])
+                writes.append((attiny.REG_PRIMED, self._storage[self.PRIMED]))
             if attiny_force_shutdown != self._storage[self.FORCE_SHUTDOWN]:
                 logging.debug("Writing Force_Shutdown to ATTiny")
-                attiny.set_force_shutdown(self._storage[self.FORCE_SHUTDOWN])
+                writes.append((attiny.REG_FORCE_SHUTDOWN, self._storage[self.FORCE_SHUTDOWN]))
             if attiny_led_off_mode != self._storage[self.LED_OFF_MODE]:
                 logging.debug("Writing LED_Off_Mode to ATTiny")
-                attiny.set_led_off_mode(self._storage[self.LED_OFF_MODE])
+                writes.append((attiny.REG_LED_OFF_MODE, self._storage[self.LED_OFF_MODE]))
             if attiny_reset_configuration != self._storage[self.RESET_CONFIG]:
                 logging.debug("Writing Reset Configuration to ATTiny")
-                attiny.set_reset_configuration(self._storage[self.RESET_CONFIG])
+                writes.append((attiny.REG_RESET_CONFIG, self._storage[self.RESET_CONFIG]))
             if attiny_reset_pulse_length != self._storage[self.RESET_PULSE_LENGTH]:
                 logging.debug("Writing Reset Pulse Length to ATTiny")
-                attiny.set_reset_pulse_length(self._storage[self.RESET_PULSE_LENGTH])
+                writes.append((attiny.REG_RESET_PULSE_LENGTH, self._storage[self.RESET_PULSE_LENGTH]))
             if attiny_switch_recovery_delay != self._storage[self.SW_RECOVERY_DELAY]:
                 logging.debug("Writing Switch Recovery Delay to ATTiny")
-                attiny.set_switch_recovery_delay(self._storage[self.SW_RECOVERY_DELAY])
+                writes.append((attiny.REG_SW_RECOVERY_DELAY, self._storage[self.SW_RECOVERY_DELAY]))
+
+        # Host Notify depends on the listener of this daemon, it is never taken from the ATTiny
+        if attiny_notify != self._storage[self.NOTIFY]:
+            logging.debug("Writing Host Notify to ATTiny")
+            writes.append((attiny.REG_NOTIFY, self._storage[self.NOTIFY]))
 
         # check for max_int and only set if sleeptime is set to that value
         if self._storage[self.SLEEPTIME] == self.MAX_INT:
             logging.debug("Sleeptime not set, calculating from timeout value")
             self._storage[self.SLEEPTIME] = self.calc_sleeptime(self._storage[self.TIMEOUT])
-            self.parser.set(self.DAEMON_SECTION, self.SLEEPTIME,
+            self.parser.set(self.section, self.SLEEPTIME,
                             str(self._storage[self.SLEEPTIME]))
             logging.debug(self._storage[self.SLEEPTIME])
             changed_config = True
 
-        if self._sync_Voltage(self.WARN_VOLTAGE, attiny, attiny.REG_WARN_VOLTAGE):
+        if self._sync_Voltage(self.WARN_VOLTAGE, attiny.REG_WARN_VOLTAGE, registers[attiny.REG_WARN_VOLTAGE], threshold_writes):
             changed_config = True
 
-        if self._sync_Voltage(self.SHUTDOWN_VOLTAGE, attiny, attiny.REG_SHUTDOWN_VOLTAGE):
+        if self._sync_Voltage(self.SHUTDOWN_VOLTAGE, attiny.REG_SHUTDOWN_VOLTAGE, registers[attiny.REG_SHUTDOWN_VOLTAGE], threshold_writes):
             changed_config = True
 
-        if self._sync_Voltage(self.RESTART_VOLTAGE, attiny, attiny.REG_RESTART_VOLTAGE):
+        if self._sync_Voltage(self.RESTART_VOLTAGE, attiny.REG_RESTART_VOLTAGE, registers[attiny.REG_RESTART_VOLTAGE], threshold_writes):
             changed_config = True
 
-        if self._sync_Voltage(self.BAT_V_COEFFICIENT, attiny, attiny.REG_BAT_V_COEFFICIENT):
+        if self._sync_Voltage(self.BAT_V_COEFFICIENT, attiny.REG_BAT_V_COEFFICIENT, registers[attiny.REG_BAT_V_COEFFICIENT], writes):
             changed_config = True
 
-        if self._sync_Voltage(self.BAT_V_CONSTANT, attiny, attiny.REG_BAT_V_CONSTANT):
+        if self._sync_Voltage(self.BAT_V_CONSTANT, attiny.REG_BAT_V_CONSTANT, registers[attiny.REG_BAT_V_CONSTANT], writes):
             changed_config = True
 
-        if self._sync_Voltage(self.EXT_V_COEFFICIENT, attiny, attiny.REG_EXT_V_COEFFICIENT):
+        if self._sync_Voltage(self.EXT_V_COEFFICIENT, attiny.REG_EXT_V_COEFFICIENT, registers[attiny.REG_EXT_V_COEFFICIENT], writes):
             changed_config = True
 
-        if self._sync_Voltage(self.EXT_V_CONSTANT, attiny, attiny.REG_EXT_V_CONSTANT):
+        if self._sync_Voltage(self.EXT_V_CONSTANT, attiny.REG_EXT_V_CONSTANT, registers[attiny.REG_EXT_V_CONSTANT], writes):
             changed_config = True
 
-        if self._sync_Voltage(self.T_COEFFICIENT, attiny, attiny.REG_T_COEFFICIENT):
+        if self._sync_Voltage(self.T_COEFFICIENT, attiny.REG_T_COEFFICIENT, registers[attiny.REG_T_COEFFICIENT], writes):
             changed_config = True
 
-        if self._sync_Voltage(self.T_CONSTANT, attiny, attiny.REG_T_CONSTANT):
+        if self._sync_Voltage(self.T_CONSTANT, attiny.REG_T_CONSTANT, registers[attiny.REG_T_CONSTANT], writes):
             changed_config = True
 
+        # older firmware does not oversample, its error value must not end up in the config file
+        if attiny.has_register(attiny.REG_OVERSAMPLING) and \
+                self._sync_Voltage(self.OVERSAMPLING, attiny.REG_OVERSAMPLING, registers[attiny.REG_OVERSAMPLING], writes):
+            changed_config = True
+
+        # the same holds for the filter parameters and the sampling profile
+        for (option, reg) in ((self.BAT_PROCESS_NOISE, attiny.REG_BAT_PROCESS_NOISE),
+                              (self.BAT_MEASURE_NOISE, attiny.REG_BAT_MEASURE_NOISE),
+                              (self.T_ALPHA, attiny.REG_T_ALPHA),
+                              (self.SAMPLING_PROFILE, attiny.REG_SAMPLING_PROFILE)):
+            if attiny.has_register(reg) and self._sync_Voltage(option, reg, registers[reg], writes):
+                changed_config = True
+
+        # registers this firmware does not know are not written
+        threshold_writes = [(reg, value) for (reg, value) in threshold_writes if attiny.has_register(reg)]
+        writes = [(reg, value) for (reg, value) in writes if attiny.has_register(reg)]
+
+        # the thresholds are written in one frame, the ATTiny never sees a mix of old and new values
+        if threshold_writes and attiny.set_many(threshold_writes):
+            values.update(threshold_writes)
+        if writes and attiny.set_many(writes):
+            values.update(writes)
+        self.write_cache(values)
+
         if changed_config:
             logging.debug("Writing new config file")
             self.write_config()
 
-    def _sync_Voltage(self, voltage_type, attiny, attiny_reg):
-        attiny_voltage = attiny.get_16bit_value(attiny_reg)
+    def _sync_Voltage(self, voltage_type, attiny_reg, attiny_voltage, writes):
         if self._storage[voltage_type] == self.MAX_INT:
             logging.debug("Getting Register " + hex(attiny_reg) + " from ATTiny")
             self._storage[voltage_type] = attiny_voltage
-            self.parser.set(self.DAEMON_SECTION, voltage_type,
+            self.parser.set(self.section, voltage_type,
                             str(self._storage[voltage_type]))
             changed_config = True
         else:
             changed_config = False
             if attiny_voltage != self._storage[voltage_type]:
                 logging.debug("Writing Register " + hex(attiny_reg) + " to ATTiny")
-                attiny.set_16bit_value(attiny_reg, self._storage[voltage_type])
+                writes.append((attiny_reg, self._storage[voltage_type]))
         return changed_config
 
 
+class HostNotifyListener:
+    # Receives the SMBus Host Notify messages the ATTiny sends when should_shutdown
+    # changes. The I2C master of the Raspberry (i2c-1) cannot receive them, we use
+    # the BSC slave peripheral through pigpio instead. Its pins (GPIO 18 SDA and
+    # GPIO 19 SCL) have to be connected to the I2C bus, i.e. to GPIO 2 and 3, and
+    # pigpiod has to be running. Without a listener wait() simply sleeps, i.e.
+    # the daemon falls back to polling.
+    HOST_ADDRESS = 0x08  # the SMBus host address
+
+    def __init__(self):
+        self._condition = threading.Condition()
+        self._messages = 0   # counts the messages, every unit waits for a change
+        self._pi = None
+        self._callback = None
+
+    def start(self):
+        try:
+            import pigpio
+        except ImportError:
+            logging.warning("pigpio is not installed.")
+            return False
+        pi = pigpio.pi()
+        if not pi.connected:
+            logging.warning("Cannot connect to pigpiod.")
+            return False
+        self._pi = pi
+        self._callback = pi.event_callback(pigpio.EVENT_BSC, self._received)
+        pi.bsc_i2c(self.HOST_ADDRESS)
+        logging.info("Listening for Host Notify messages")
+        return True
+
+    def _received(self, event, tick):
+        (status, count, data) = self._pi.bsc_i2c(self.HOST_ADDRESS)
+        # each message consists of the address of the sender and a 16 bit data word
+        for pos in range(0, count - 2, 3):
+            logging.debug("Host Notify from " + hex(data[pos] >> 1) + ": " +
+                          hex(data[pos + 1] | (data[pos + 2] << 8)))
+        if count >= 3:
+            self.wake()
+
+    def wake(self):
+        # wakes all units waiting in wait()
+        with self._condition:
+            self._messages += 1
+            self._condition.notify_all()
+
+    def wait(self, timeout):
+        # returns True if a message has been received before the timeout
+        with self._condition:
+            seen = self._messages
+            return self._condition.wait_for(lambda: self._messages != seen, timeout)
+
+    def stop(self):
+        if self._pi is not None:
+            self._callback.cancel()
+            self._pi.bsc_i2c(0)  # disable the BSC peripheral
+            self._pi.stop()
+            self._pi = None
+
+
+def log_link_counters(attiny):
+    # the error counters of the I2C link help to tune _time_const and _num_retries
+    counters = attiny.get_link_counters()
+    logging.info("I2C link counters: " +
+                 ", ".join(name + " " + str(value) for (name, value) in counters.items()))
+
+
+def log_battery_health(attiny):
+    # the health is estimated from the voltage sag when the Raspberry is switched, a
+    # falling health tells us to replace the battery before it fails under load
+    if not attiny.has_register(attiny.REG_BATTERY_HEALTH):
+        return
+    health = attiny.get_battery_health()
+    if health == ATTiny.HEALTH_UNKNOWN:
+        logging.info("Battery health not known yet, no load step has been measured.")
+    elif health <= 100:
+        logging.info("Battery health " + str(health) + "%, average voltage sag " +
+                     str(attiny.get_sag_average()) + "mV (" + str(attiny.get_sag_reference()) +
+                     "mV when new).")
+        if health < 50:
+            logging.warning("Battery health is low, consider replacing the battery.")
+
+
+def log_power_event(attiny, seen):
+    # logs a change of the external voltage latched by the firmware, returns the
+    # number of changes seen. At the start only a missing voltage is logged.
+    event = attiny.get_power_event()
+    if event is None:
+        return seen
+    if event['events'] != seen:
+        # the age is 0xFFFF if the voltage has not changed since the ATTiny started
+        since = "" if event['age'] == 0xFFFF else " " + str(event['age']) + " seconds ago"
+        if not event['present']:
+            logging.warning("External voltage lost" + since + ". We are on battery power.")
+            if attiny.has_register(attiny.REG_TIME_TO_WARN):
+                log_time_left(attiny.get_time_to_warn(), "the warn voltage")
+        elif seen is not None:
+            logging.info("External voltage returned" + since + ".")
+    return event['events']
+
+
+def log_shutdown_causes(should_shutdown):
+    # the firmware signals each cause in its own bit, several can be set at once
+    for bit in range(8):
+        level = 2**bit
+        if level == SL_INITIATED or (should_shutdown & level) == 0:
+            continue
+        fallback = "Unknown shutdown cause " + str(level) + "."
+        if level > 16:
+            fallback += " Shutting down."
+        logging.warning(shutdown_levels.get(level, fallback))
+
+
+def log_time_left(time, threshold):
+    # logs the time the firmware predicts until the battery reaches a threshold
+    if time == ATTiny.RUNTIME_UNKNOWN:
+        logging.info("The time until " + threshold + " is not known yet.")
+    elif time != 0xFFFFFFFF:
+        logging.info("About " + str(time // 60) + " minutes until " + threshold + ".")
+
+
 def read_geekworm():
     try:
         address = 0x36
@@ -7,7 +7,9 @@ import logging
 
 from attiny_i2c import ATTiny
 
-# This short script logs the current temperature and battery voltage to MQTT in JSON-format.
+# This short script logs the current temperature, battery voltage, state of charge, battery health
+# and the I2C link counters
+# to MQTT in JSON-format.
 # Change the following settings to your needs and add the following line to the
 # crontab of the user pi (without the leading hash-sign):
 # * * * * * /opt/attiny_daemon/attiny_daemon_mqtt_status.py
@@ -43,14 +45,21 @@ bus = smbus.SMBus(1)
 attiny = ATTiny(bus, _i2c_address, _time_const, _num_retries)
 
 # access data, an error is signalled by a return value of 0xFFFFFFFF/4294967295
-temperature = str(attiny.get_temperature())
-voltage = str(attiny.get_bat_voltage())
+snapshot = attiny.get_snapshot()
+temperature = str(snapshot['temperature'])
+voltage = str(snapshot['bat_voltage'])
+charge = str(snapshot['state_of_charge'])
+health = str(attiny.get_battery_health())
 uptime = str(get_uptime())
+link_counters = attiny.get_link_counters()
 
 #build output
 json_string = '{"temperature" : ' + temperature  \
               + ', "battery_voltage" : ' + voltage \
-              + ', "uptime" : ' + uptime;
+              + ', "battery_percent" : ' + charge \
+              + ', "battery_health" : ' + health \
+              + ', "uptime" : ' + uptime \
+              + ''.join(', "i2c_' + name + '" : ' + str(value) for (name, value) in link_counters.items());
 if _additional_info == None:
     json_string = json_string + '}';
 else:
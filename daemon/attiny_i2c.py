@@ -1,4 +1,5 @@
 
+import binascii
 import logging
 import os
 import sys
@@ -11,6 +12,18 @@ from argparse import ArgumentParser, Namespace
 from collections.abc import Mapping
 from pathlib import Path
 
+def _crc_table(polynome):
+    # the CRC of every possible byte value, i.e. the bitwise calculation of addCrc()
+    # done once in advance for all 256 values
+    table = []
+    for n in range(0, 256):
+        crc = n
+        for bitnumber in range(0, 8):
+            if crc & 0x80 : crc = ( crc << 1 ) ^ polynome
+            else          : crc = ( crc << 1 )
+        table.append(crc & 0xFF)
+    return tuple(table)
+
 class ATTiny:
     REG_LAST_ACCESS        = 0x01
     REG_BAT_VOLTAGE        = 0x11
@@ -19,28 +32,201 @@ class ATTiny:
     REG_BAT_V_CONSTANT     = 0x14
     REG_EXT_V_COEFFICIENT  = 0x15
     REG_EXT_V_CONSTANT     = 0x16
+    REG_OVERSAMPLING       = 0x17
+    REG_STATE_OF_CHARGE    = 0x18
     REG_TIMEOUT            = 0x21
     REG_PRIMED             = 0x22
     REG_SHOULD_SHUTDOWN    = 0x23
     REG_FORCE_SHUTDOWN     = 0x24
     REG_LED_OFF_MODE       = 0x25
+    REG_NOTIFY             = 0x26
     REG_RESTART_VOLTAGE    = 0x31
     REG_WARN_VOLTAGE       = 0x32
     REG_SHUTDOWN_VOLTAGE   = 0x33
+    REG_TIME_TO_WARN       = 0x34
+    REG_TIME_TO_SHUTDOWN   = 0x35
     REG_TEMPERATURE        = 0x41
     REG_T_COEFFICIENT      = 0x42
     REG_T_CONSTANT         = 0x43
     REG_RESET_CONFIG       = 0x51
     REG_RESET_PULSE_LENGTH = 0x52
     REG_SW_RECOVERY_DELAY  = 0x53
+    REG_BAT_PROCESS_NOISE  = 0x61
+    REG_BAT_MEASURE_NOISE  = 0x62
+    REG_T_ALPHA            = 0x63
+    REG_SAMPLING_PROFILE   = 0x64
+    REG_SAG_REFERENCE      = 0x71
+    REG_SAG_AVERAGE        = 0x72
+    REG_BATTERY_HEALTH     = 0x73
     REG_VERSION            = 0x80
     REG_FUSE_LOW           = 0x81
     REG_FUSE_HIGH          = 0x82
     REG_FUSE_EXTENDED      = 0x83
     REG_INTERNAL_STATE     = 0x84
+    REG_EEPROM_PENDING     = 0x85
+    REG_I2C_ADDRESS        = 0x86
+    REG_SNAPSHOT           = 0x90
+    REG_CHANGED            = 0x91
+    REG_LINK_COUNTERS      = 0x92
+    REG_FEATURES           = 0x93
+    REG_WRITE_STATUS       = 0x94
+    REG_POWER_EVENT        = 0x95
+    REG_LOAD_STEP          = 0x96
+    REG_BLOCK_VOLTAGES     = 0xB1
+    REG_BLOCK_CONTROL      = 0xB2
+    REG_BLOCK_THRESHOLDS   = 0xB3
+    REG_BLOCK_TEMPERATURE  = 0xB4
+    REG_BLOCK_RESET        = 0xB5
+    REG_BLOCK_FILTERS      = 0xB6
+    REG_BLOCK_BATTERY      = 0xB7
+    REG_BLOCK_IDENTITY     = 0xB8
+    REG_STREAM_CURSOR      = 0xC0
+    REG_STREAM_CHUNK       = 0xC1
+    REG_STREAM_RETRY       = 0xC2
+    REG_DESCRIPTORS        = 0xD0
+    REG_BATCH_WRITE        = 0xF0
     REG_INIT_EEPROM        = 0xFF
 
     _POLYNOME = 0x31
+    _CRC_TABLE = _crc_table(_POLYNOME)
+    _MAX_FRAME = 16  # the size of the receive buffer of the firmware, limits batch writes
+
+    # layout of the snapshot register, has to match struct Snapshot in the firmware:
+    # bat_voltage, ext_voltage, temperature, seconds, state, should_shutdown, state_of_charge
+    _SNAPSHOT_FORMAT = '<HHhHBBB'
+    _SNAPSHOT_FIELDS = ('bat_voltage', 'ext_voltage', 'temperature', 'last_access',
+                        'internal_state', 'should_shutdown', 'state_of_charge')
+
+    # layout of the link counters, has to match struct Link_Counters in the firmware
+    _LINK_COUNTERS_FORMAT = '<HHHHH'
+    _LINK_COUNTERS_FIELDS = ('transactions', 'crc_errors', 'oversize', 'unknown_register',
+                             'read_without_register')
+
+    # layout of the stream cursor (stream, offset, length), has to match struct Stream_Cursor
+    # in the firmware. A chunk holds its offset, up to _STREAM_CHUNK_SIZE bytes and a CRC-16.
+    _STREAM_CURSOR_FORMAT = '<BHH'
+    _STREAM_CHUNK_SIZE = 12
+    _STREAM_BUSY = 0xFFFF  # the offset of a chunk refused while the firmware writes the EEPROM
+    # the history stream starts with the sample interval and the age of the newest sample
+    _HISTORY_HEADER_FORMAT = '<HH'
+
+    # layout of the power event register, has to match struct Power_Event in the firmware
+    _POWER_EVENT_FORMAT = '<BBH'
+    _POWER_EVENT_FIELDS = ('present', 'events', 'age')
+
+    # layout of the load step register (kind, voltage before and after in mV), has to
+    # match struct Load_Step in the firmware
+    _LOAD_STEP_FORMAT = '<BHH'
+    _LOAD_STEP_FIELDS = ('kind', 'before', 'after')
+
+    # the feature bits of the features register, see namespace Feature in the firmware
+    FEATURE_SNAPSHOT       = 1 << 0
+    FEATURE_CHANGE_BITMAP  = 1 << 1
+    FEATURE_LINK_COUNTERS  = 1 << 2
+    FEATURE_BLOCK_READ     = 1 << 3
+    FEATURE_BATCH_WRITE    = 1 << 4
+    FEATURE_HOST_NOTIFY    = 1 << 5
+    FEATURE_WRITE_STATUS   = 1 << 6
+    FEATURE_STREAMS        = 1 << 7
+    FEATURE_POWER_EVENTS   = 1 << 8
+    FEATURE_LOAD_STEPS     = 1 << 9
+
+    # the sampling profiles, see namespace Sampling_Profile in the firmware
+    SAMPLING_FIXED         = 0
+    SAMPLING_ADAPTIVE      = 1
+
+    # the state of charge before the first measurement, see SOC_UNKNOWN in the firmware
+    SOC_UNKNOWN            = 0xFF
+    # the predicted time while the battery is not discharged, see RUNTIME_UNKNOWN in the firmware
+    RUNTIME_UNKNOWN        = 0xFFFF
+    # the battery health before the first load step, see HEALTH_UNKNOWN in the firmware
+    HEALTH_UNKNOWN         = 0xFF
+
+    # the kinds of load steps, see namespace Load_Step_Kind in the firmware
+    LOAD_STEP_NONE         = 0
+    LOAD_STEP_UPS_ON       = 1
+    LOAD_STEP_UPS_OFF      = 2
+    LOAD_STEP_POWER_LOSS   = 3
+
+    # the streams of the firmware, see namespace Stream_Id in the firmware
+    STREAM_HISTORY         = 0
+    STREAM_EEPROM          = 1
+
+    # the result codes of the write status register, see namespace Write_Result in the firmware
+    WRITE_APPLIED          = 0
+    WRITE_CRC_MISMATCH     = 1
+    WRITE_UNKNOWN_REGISTER = 2
+    WRITE_READ_ONLY        = 3
+    WRITE_WRONG_SIZE       = 4
+    WRITE_OUT_OF_RANGE     = 5
+    WRITE_OVERSIZE         = 6
+    _WRITE_RESULT_NAMES = {WRITE_APPLIED: "applied", WRITE_CRC_MISMATCH: "crc mismatch",
+                           WRITE_UNKNOWN_REGISTER: "unknown register", WRITE_READ_ONLY: "read-only",
+                           WRITE_WRONG_SIZE: "wrong size", WRITE_OUT_OF_RANGE: "out of range",
+                           WRITE_OVERSIZE: "oversize"}
+    # a retry cannot fix these
+    _WRITE_REJECTED = (WRITE_UNKNOWN_REGISTER, WRITE_READ_ONLY, WRITE_WRONG_SIZE, WRITE_OUT_OF_RANGE)
+
+    # the flags of a register in the descriptor pages, see namespace Register_Flag in the firmware
+    _FLAG_SIZE      = 0x07
+    _FLAG_SIGNED    = 0x08
+    _FLAG_WRITABLE  = 0x10
+    _FLAG_PERSISTED = 0x20
+    _FLAG_READABLE  = 0x40
+    _DESCRIPTORS_PER_PAGE = 6
+    _MAX_BLOCK = 15  # the size of the block buffer of the firmware
+
+    # The built-in description of the firmware registers. It is used if the firmware
+    # cannot describe itself, otherwise discover() replaces it with the register table
+    # read from the firmware.
+    _FEATURES = (FEATURE_SNAPSHOT | FEATURE_CHANGE_BITMAP | FEATURE_LINK_COUNTERS |
+                 FEATURE_BLOCK_READ | FEATURE_BATCH_WRITE | FEATURE_HOST_NOTIFY |
+                 FEATURE_WRITE_STATUS | FEATURE_STREAMS | FEATURE_POWER_EVENTS |
+                 FEATURE_LOAD_STEPS)
+
+    # the registers streamed by a burst read of a block, in firmware order, together
+    # with their struct format
+    _BLOCKS = {
+        REG_BLOCK_VOLTAGES: ((REG_BAT_VOLTAGE, 'H'), (REG_EXT_VOLTAGE, 'H'),
+                             (REG_BAT_V_COEFFICIENT, 'H'), (REG_BAT_V_CONSTANT, 'h'),
+                             (REG_EXT_V_COEFFICIENT, 'H'), (REG_EXT_V_CONSTANT, 'h'),
+                             (REG_OVERSAMPLING, 'B'), (REG_STATE_OF_CHARGE, 'B')),
+        REG_BLOCK_CONTROL: ((REG_TIMEOUT, 'B'), (REG_PRIMED, 'B'), (REG_SHOULD_SHUTDOWN, 'B'),
+                            (REG_FORCE_SHUTDOWN, 'B'), (REG_LED_OFF_MODE, 'B'), (REG_NOTIFY, 'B')),
+        REG_BLOCK_THRESHOLDS: ((REG_RESTART_VOLTAGE, 'H'), (REG_WARN_VOLTAGE, 'H'),
+                               (REG_SHUTDOWN_VOLTAGE, 'H'), (REG_TIME_TO_WARN, 'H'),
+                               (REG_TIME_TO_SHUTDOWN, 'H')),
+        REG_BLOCK_TEMPERATURE: ((REG_TEMPERATURE, 'h'), (REG_T_COEFFICIENT, 'H'),
+                                (REG_T_CONSTANT, 'h')),
+        REG_BLOCK_RESET: ((REG_RESET_CONFIG, 'B'), (REG_RESET_PULSE_LENGTH, 'H'),
+                          (REG_SW_RECOVERY_DELAY, 'H')),
+        REG_BLOCK_FILTERS: ((REG_BAT_PROCESS_NOISE, 'H'), (REG_BAT_MEASURE_NOISE, 'H'),
+                            (REG_T_ALPHA, 'B'), (REG_SAMPLING_PROFILE, 'B')),
+        REG_BLOCK_BATTERY: ((REG_SAG_REFERENCE, 'H'), (REG_SAG_AVERAGE, 'H'),
+                            (REG_BATTERY_HEALTH, 'B')),
+        REG_BLOCK_IDENTITY: ((REG_VERSION, 'I'), (REG_FUSE_LOW, 'B'), (REG_FUSE_HIGH, 'B'),
+                             (REG_FUSE_EXTENDED, 'B'), (REG_INTERNAL_STATE, 'B'),
+                             (REG_EEPROM_PENDING, 'B'), (REG_I2C_ADDRESS, 'H')),
+    }
+    # the registers in the order of the register table of the firmware, bit n of
+    # the change bitmap belongs to the n-th register of this list
+    _TABLE_ROWS = (REG_LAST_ACCESS, REG_BAT_VOLTAGE, REG_EXT_VOLTAGE,
+                   REG_BAT_V_COEFFICIENT, REG_BAT_V_CONSTANT, REG_EXT_V_COEFFICIENT,
+                   REG_EXT_V_CONSTANT, REG_OVERSAMPLING, REG_STATE_OF_CHARGE, REG_TIMEOUT, REG_PRIMED,
+                   REG_SHOULD_SHUTDOWN, REG_FORCE_SHUTDOWN, REG_LED_OFF_MODE, REG_NOTIFY, REG_RESTART_VOLTAGE,
+                   REG_WARN_VOLTAGE, REG_SHUTDOWN_VOLTAGE, REG_TIME_TO_WARN, REG_TIME_TO_SHUTDOWN,
+                   REG_TEMPERATURE,
+                   REG_T_COEFFICIENT, REG_T_CONSTANT, REG_RESET_CONFIG,
+                   REG_RESET_PULSE_LENGTH, REG_SW_RECOVERY_DELAY, REG_BAT_PROCESS_NOISE,
+                   REG_BAT_MEASURE_NOISE, REG_T_ALPHA, REG_SAMPLING_PROFILE, REG_SAG_REFERENCE,
+                   REG_SAG_AVERAGE, REG_BATTERY_HEALTH, REG_VERSION,
+                   REG_FUSE_LOW, REG_FUSE_HIGH, REG_FUSE_EXTENDED, REG_INTERNAL_STATE,
+                   REG_EEPROM_PENDING, REG_I2C_ADDRESS, REG_INIT_EEPROM)
+    _CHANGED_SIZE = 8  # the size of the change bitmap (64 rows)
+
+    # the struct format of each register and the block it can be read with
+    _FORMATS = {reg: fmt for layout in _BLOCKS.values() for (reg, fmt) in layout}
+    _REGISTER_BLOCK = {reg: block for (block, layout) in _BLOCKS.items() for (reg, fmt) in layout}
 
     def __init__(self, bus, address, time_const, num_retries):
         self._bus = bus
@@ -48,7 +234,9 @@ class ATTiny:
         self._time_const_read = time_const
         self._time_const_write = time_const + 0.3
         self._num_retries = num_retries
+        self._write_sequence = None  # the sequence number of the last write status read
 
+    # bitwise reference implementation, calcCRC() uses the table instead
     def addCrc(self, crc, n):
       for bitnumber in range(0,8):
         if ( n ^ crc ) & 0x80 : crc = ( crc << 1 ) ^ self._POLYNOME
@@ -57,9 +245,10 @@ class ATTiny:
       return crc & 0xFF
 
     def calcCRC(self, register, read, len):
-      crc = self.addCrc(0, register)
+      table = self._CRC_TABLE
+      crc = table[register & 0xFF]
       for elem in range(0, len):
-        crc = self.addCrc(crc, read[elem])
+        crc = table[crc ^ read[elem]]
       return crc
 
     def set_timeout(self, timeout):
@@ -80,25 +269,124 @@ class ATTiny:
     def set_led_off_mode(self, value):
         return self.set_8bit_value(self.REG_LED_OFF_MODE, value)
 
+    def set_notify(self, value):
+        return self.set_8bit_value(self.REG_NOTIFY, value)
+
     def set_reset_configuration(self, value):
         return self.set_8bit_value(self.REG_RESET_CONFIG, value)
 
     def set_8bit_value(self, register, value):
-        crc = self.addCrc(0, register)
-        crc = self.addCrc(crc, value)
+        crc = self.calcCRC(register, [value], 1)
 
         arg_list = [value, crc]
+        self._sync_write_sequence()
         for x in range(self._num_retries):
             time.sleep(self._time_const_write)
             try:
                 self._bus.write_i2c_block_data(self._address, register, arg_list)
-                if (self.get_8bit_value(register)) == value:
+                result = self._confirm_write(register, lambda: self.get_8bit_value(register) == value)
+                if result == self.WRITE_APPLIED:
                     return True
+                if result in self._WRITE_REJECTED:
+                    return False
             except Exception as e:
                 logging.debug("Couldn't set 8 bit register " + hex(register) + ". Exception: " + str(e))
         logging.warning("Couldn't set 8 bit register after " + str(self._num_retries) + " retries.")
         return False
 
+    def set_many(self, values):
+        # writes a list of (register, value) tuples using as few batch writes as possible.
+        # All registers of one batch are applied atomically by the firmware.
+        if not self.has_feature(self.FEATURE_BATCH_WRITE):
+            results = [self.set_value(register, value) for (register, value) in values]
+            return all(results)
+        batches = [[]]
+        size = 1  # bytes used by the count and the pairs of the current batch
+        for (register, value) in values:
+            pair_size = 1 + struct.calcsize('<' + self._FORMATS[register])
+            # the frame consists of register number, count, pairs and crc
+            if size + pair_size + 2 > self._MAX_FRAME:
+                batches.append([])
+                size = 1
+            batches[-1].append((register, value))
+            size += pair_size
+
+        success = True
+        for batch in batches:
+            if batch and not self._write_batch(batch):
+                success = False
+        return success
+
+    def _write_batch(self, batch):
+        data = [len(batch)]
+        for (register, value) in batch:
+            data.append(register)
+            data += struct.pack('<' + self._FORMATS[register], value)
+        data.append(self.calcCRC(self.REG_BATCH_WRITE, data, len(data)))
+
+        # without the write status registers are verified by reading their blocks
+        blocks = {self._REGISTER_BLOCK[register] for (register, value) in batch}
+
+        def read_back():
+            read = {}
+            for block in blocks:
+                read.update(self.get_block(block))
+            return all(read[register] == value for (register, value) in batch)
+
+        self._sync_write_sequence()
+        for x in range(self._num_retries):
+            time.sleep(self._time_const_write)
+            try:
+                self._bus.write_i2c_block_data(self._address, self.REG_BATCH_WRITE, data)
+                result = self._confirm_write(self.REG_BATCH_WRITE, read_back)
+                if result == self.WRITE_APPLIED:
+                    return True
+                if result in self._WRITE_REJECTED:
+                    return False
+            except Exception as e:
+                logging.debug("Couldn't write batch of registers. Exception: " + str(e))
+        logging.warning("Couldn't write batch of registers after " + str(self._num_retries) + " retries.")
+        return False
+
+    def get_write_status(self):
+        # reads the result of the last write frame received by the firmware, returns
+        # a tuple of register, result code and sequence number or None
+        read = self.read_frame(self.REG_WRITE_STATUS, 3)
+        if read is None:
+            return None
+        return tuple(read)
+
+    def _sync_write_sequence(self):
+        # a write is confirmed by a new sequence number, so we need the current one
+        # before the first write
+        if self._write_sequence is None and self.has_feature(self.FEATURE_WRITE_STATUS):
+            status = self.get_write_status()
+            if status is not None:
+                self._write_sequence = status[2]
+
+    def _confirm_write(self, register, read_back):
+        # confirms a write with a single read of the write status, firmware without
+        # it is checked with read_back(). Returns the result code of the write or
+        # None if it cannot be confirmed (e.g. it has not been received).
+        if not self.has_feature(self.FEATURE_WRITE_STATUS) or self._write_sequence is None:
+            return self.WRITE_APPLIED if read_back() else None
+        status = self.get_write_status()
+        if status is None:
+            return None
+        (reg, result, sequence) = status
+        previous = self._write_sequence
+        self._write_sequence = sequence
+        if sequence == previous or reg != register:
+            logging.debug("The write of register " + hex(register) + " has not been received.")
+            return None
+        if result in self._WRITE_REJECTED:
+            logging.warning("The write of register " + hex(register) + " has been rejected: " +
+                            self._WRITE_RESULT_NAMES[result])
+        elif result != self.WRITE_APPLIED:
+            logging.debug("The write of register " + hex(register) + " failed: " +
+                          self._WRITE_RESULT_NAMES.get(result, hex(result)))
+        return result
+
     def set_restart_voltage(self, value):
         return self.set_16bit_value(self.REG_RESTART_VOLTAGE, value)
 
@@ -126,6 +414,34 @@ class ATTiny:
     def set_ext_v_constant(self, value):
         return self.set_16bit_value(self.REG_EXT_V_CONSTANT, value)
 
+    def set_oversampling(self, value):
+        # 2 bits per channel (battery, external voltage, temperature from bit 0 on),
+        # 0 = no oversampling, 1 = 4x, 2 = 16x, 3 = 64x
+        return self.set_8bit_value(self.REG_OVERSAMPLING, value)
+
+    def set_bat_process_noise(self, value):
+        # the variance of the battery voltage between two measurements of the Kalman
+        # filter, in raw ADC counts squared (16 bit). Larger values follow faster.
+        return self.set_16bit_value(self.REG_BAT_PROCESS_NOISE, value)
+
+    def set_bat_measurement_noise(self, value):
+        # the variance of a single battery voltage measurement, larger values smooth more
+        return self.set_16bit_value(self.REG_BAT_MEASURE_NOISE, value)
+
+    def set_temperature_alpha(self, value):
+        # the weight of a temperature measurement in its average * 256 (1 - 254)
+        return self.set_8bit_value(self.REG_T_ALPHA, value)
+
+    def set_sampling_profile(self, value):
+        # SAMPLING_FIXED measures on every wake, SAMPLING_ADAPTIVE measures rarely
+        # while the battery is stable and on every wake while it is discharged
+        return self.set_8bit_value(self.REG_SAMPLING_PROFILE, value)
+
+    def set_sag_reference(self, value):
+        # the voltage sag of the new battery in mV, the battery health is relative to
+        # it. Write 0 after replacing the battery, the firmware then takes the next sag.
+        return self.set_16bit_value(self.REG_SAG_REFERENCE, value)
+
     def set_reset_pulse_length(self, value):
         return self.set_16bit_value(self.REG_RESET_PULSE_LENGTH, value)
 
@@ -133,18 +449,26 @@ class ATTiny:
         return self.set_16bit_value(self.REG_SW_RECOVERY_DELAY, value)
 
     def set_16bit_value(self, register, value):
-        # we interpret every value as a 16-bit signed value
-        vals = value.to_bytes(2, byteorder='little', signed=True)
+        # the value is encoded with the signedness of the register, see _is_signed()
+        try:
+            vals = value.to_bytes(2, byteorder='little', signed=self._is_signed(register))
+        except OverflowError:
+            logging.warning("Value " + str(value) + " does not fit into 16 bit register " + hex(register) + ".")
+            return False
         crc = self.calcCRC(register, vals, 2)
 
         arg_list = [vals[0], vals[1], crc]
 
+        self._sync_write_sequence()
         for x in range(self._num_retries):
             time.sleep(self._time_const_write)
             try:
                 self._bus.write_i2c_block_data(self._address, register, arg_list)
-                if (self.get_16bit_value(register)) == value:
+                result = self._confirm_write(register, lambda: self.get_16bit_value(register) == value)
+                if result == self.WRITE_APPLIED:
                     return True
+                if result in self._WRITE_REJECTED:
+                    return False
             except Exception as e:
                 logging.debug("Couldn't set 16 bit register " + hex(register) + ". Exception: " + str(e))
         logging.warning("Couldn't set 16 bit register after " + str(self._num_retries) + " retries.")
@@ -171,6 +495,37 @@ class ATTiny:
     def get_ext_v_constant(self):
         return self.get_16bit_value(self.REG_EXT_V_CONSTANT)
 
+    def get_oversampling(self):
+        return self.get_8bit_value(self.REG_OVERSAMPLING)
+
+    def get_state_of_charge(self):
+        # the remaining capacity of the battery in percent, SOC_UNKNOWN before the
+        # first measurement of the firmware
+        return self.get_8bit_value(self.REG_STATE_OF_CHARGE)
+
+    def get_bat_process_noise(self):
+        return self.get_16bit_value(self.REG_BAT_PROCESS_NOISE)
+
+    def get_bat_measurement_noise(self):
+        return self.get_16bit_value(self.REG_BAT_MEASURE_NOISE)
+
+    def get_temperature_alpha(self):
+        return self.get_8bit_value(self.REG_T_ALPHA)
+
+    def get_sampling_profile(self):
+        return self.get_8bit_value(self.REG_SAMPLING_PROFILE)
+
+    def get_sag_reference(self):
+        return self.get_16bit_value(self.REG_SAG_REFERENCE)
+
+    def get_sag_average(self):
+        return self.get_16bit_value(self.REG_SAG_AVERAGE)
+
+    def get_battery_health(self):
+        # 100 for a new battery, 0 when its voltage sag has doubled, HEALTH_UNKNOWN
+        # before the first load step
+        return self.get_8bit_value(self.REG_BATTERY_HEALTH)
+
     def get_restart_voltage(self):
         return self.get_16bit_value(self.REG_RESTART_VOLTAGE)
 
@@ -180,6 +535,15 @@ class ATTiny:
     def get_shutdown_voltage(self):
         return self.get_16bit_value(self.REG_SHUTDOWN_VOLTAGE)
 
+    def get_time_to_warn(self):
+        # the predicted seconds until the battery reaches the warn voltage (unsigned),
+        # RUNTIME_UNKNOWN while it is not discharged
+        return self.get_value(self.REG_TIME_TO_WARN)
+
+    def get_time_to_shutdown(self):
+        # the predicted seconds until the battery reaches the shutdown voltage
+        return self.get_value(self.REG_TIME_TO_SHUTDOWN)
+
     def get_temperature(self):
         return self.get_16bit_value(self.REG_TEMPERATURE)
 
@@ -195,13 +559,17 @@ class ATTiny:
     def get_switch_recovery_delay(self):
         return self.get_16bit_value(self.REG_SW_RECOVERY_DELAY)
 
+    def _is_signed(self, register):
+        # the signedness of a 16 bit register as given by the register table, registers
+        # unknown to it are treated as signed as before
+        return self._FORMATS.get(register, 'h') == 'h'
+
     def get_16bit_value(self, register):
         for x in range(self._num_retries):
             time.sleep(self._time_const_read)
             try:
                 read = self._bus.read_i2c_block_data(self._address, register, 3)
-                # we interpret every value as a 16-bit signed value
-                val = int.from_bytes(read[0:2], byteorder='little', signed=True)
+                val = int.from_bytes(read[0:2], byteorder='little', signed=self._is_signed(register))
                 if read[2] == self.calcCRC(register, read, 2):
                     return val
                 logging.debug("Couldn't read 16 bit register " + hex(register) + " correctly.")
@@ -240,6 +608,40 @@ class ATTiny:
     def get_internal_state(self):
         return self.get_8bit_value(self.REG_INTERNAL_STATE)
 
+    def get_eeprom_pending(self):
+        # number of registers the firmware has not yet written to its EEPROM
+        return self.get_8bit_value(self.REG_EEPROM_PENDING)
+
+    def get_i2c_address(self):
+        # the address the firmware uses, it is stored together with its complement
+        read = self.read_frame(self.REG_I2C_ADDRESS, 2)
+        if read is None:
+            return 0xFFFF
+        return read[0]
+
+    def set_i2c_address(self, address):
+        # The firmware only accepts the new address followed by its complement and
+        # switches to it after the write, the write is verified at the new address.
+        # Afterwards this object uses the new address.
+        data = [address, ~address & 0xFF]
+        data.append(self.calcCRC(self.REG_I2C_ADDRESS, data, 2))
+        for x in range(self._num_retries):
+            time.sleep(self._time_const_write)
+            try:
+                self._bus.write_i2c_block_data(self._address, self.REG_I2C_ADDRESS, data)
+            except Exception as e:
+                logging.debug("Couldn't set I2C address. Exception: " + str(e))
+            time.sleep(self._time_const_read)
+            try:
+                read = self._bus.read_i2c_block_data(address, self.REG_I2C_ADDRESS, 3)
+                if read == data:
+                    self._address = address
+                    return True
+            except Exception as e:
+                logging.debug("Couldn't read I2C address at " + hex(address) + ". Exception: " + str(e))
+        logging.warning("Couldn't set I2C address after " + str(self._num_retries) + " retries.")
+        return False
+
     def get_8bit_value(self, register):
         for x in range(self._num_retries):
             time.sleep(self._time_const_read)
@@ -270,3 +672,297 @@ class ATTiny:
         logging.warning("Couldn't read version information after " + str(self._num_retries) + " retries.")
         return (0xFFFF, 0xFFFF, 0xFFFF)
 
+
+    def get_snapshot(self):
+        # reads all live telemetry with a single transaction
+        size = struct.calcsize(self._SNAPSHOT_FORMAT)
+        read = self.read_frame(self.REG_SNAPSHOT, size)
+        if read is None:
+            # signal the error the same way as the single register reads
+            values = (0xFFFFFFFF, 0xFFFFFFFF, 0xFFFFFFFF, 0xFFFFFFFF, 0xFFFF, 0xFFFF, 0xFFFF)
+        else:
+            values = struct.unpack(self._SNAPSHOT_FORMAT, bytes(read))
+        return dict(zip(self._SNAPSHOT_FIELDS, values))
+
+    def discover(self):
+        # Reads the register table and the features of the firmware and builds the
+        # register formats, blocks and the row order of the change bitmap from it.
+        # The results shadow the built-in class attributes of the same name. Returns
+        # False (and keeps the built-in description) if the firmware does not
+        # describe itself.
+        read = self.read_frame(self.REG_FEATURES, 3)
+        if read is None:
+            return False
+        (count, features) = struct.unpack('<BH', bytes(read))
+
+        rows = []
+        for page in range(0, (count + self._DESCRIPTORS_PER_PAGE - 1) // self._DESCRIPTORS_PER_PAGE):
+            length = min(self._DESCRIPTORS_PER_PAGE, count - len(rows))
+            read = self.read_frame(self.REG_DESCRIPTORS + page, 2 * length)
+            if read is None:
+                return False
+            rows += [(read[pos], read[pos + 1]) for pos in range(0, 2 * length, 2)]
+
+        formats = {}
+        for (reg, flags) in rows:
+            size = flags & self._FLAG_SIZE
+            if size == 2:
+                formats[reg] = 'h' if flags & self._FLAG_SIGNED else 'H'
+            else:
+                formats[reg] = {1: 'B', 4: 'I'}[size]
+
+        # the firmware streams the readable registers of each block (same high
+        # nibble) in table order until its block buffer is full
+        blocks = {}
+        if features & self.FEATURE_BLOCK_READ:
+            full = set()
+            for (reg, flags) in rows:
+                block = 0xB0 | (reg >> 4)
+                if not (flags & self._FLAG_READABLE) or block in full:
+                    continue
+                layout = blocks.setdefault(block, [])
+                if sum(struct.calcsize(fmt) for (r, fmt) in layout) + (flags & self._FLAG_SIZE) > self._MAX_BLOCK:
+                    full.add(block)  # the firmware stops at the first register that does not fit
+                    continue
+                layout.append((reg, formats[reg]))
+            blocks = {block: tuple(layout) for (block, layout) in blocks.items()}
+
+        self._FEATURES = features
+        self._TABLE_ROWS = tuple(reg for (reg, flags) in rows)
+        self._FORMATS = formats
+        self._BLOCKS = blocks
+        self._REGISTER_BLOCK = {reg: block for (block, layout) in blocks.items() for (reg, fmt) in layout}
+        return True
+
+    def has_feature(self, feature):
+        return (self._FEATURES & feature) != 0
+
+    def has_register(self, register):
+        return register in self._FORMATS
+
+    def registers(self):
+        # the registers of the firmware in table order
+        return self._TABLE_ROWS
+
+    def get_value(self, register):
+        # reads any register of the register table, the format is taken from the
+        # description of the firmware. Errors are signalled like the other reads.
+        fmt = '<' + self._FORMATS[register]
+        read = self.read_frame(register, struct.calcsize(fmt))
+        if read is None:
+            return 0xFFFF if fmt == '<B' else 0xFFFFFFFF
+        return struct.unpack(fmt, bytes(read))[0]
+
+    def set_value(self, register, value):
+        # writes any writable register of the register table
+        if self.has_feature(self.FEATURE_BATCH_WRITE):
+            return self.set_many([(register, value)])
+        if struct.calcsize('<' + self._FORMATS[register]) == 1:
+            return self.set_8bit_value(register, value)
+        return self.set_16bit_value(register, value)
+
+    def get_link_counters(self):
+        # reads the I2C error counters of the firmware, they saturate at 0xFFFF
+        size = struct.calcsize(self._LINK_COUNTERS_FORMAT)
+        read = self.read_frame(self.REG_LINK_COUNTERS, size)
+        if read is None:
+            values = (0xFFFFFFFF,) * len(self._LINK_COUNTERS_FIELDS)
+        else:
+            values = struct.unpack(self._LINK_COUNTERS_FORMAT, bytes(read))
+        return dict(zip(self._LINK_COUNTERS_FIELDS, values))
+
+    def get_power_event(self):
+        # reads the latched changes of the external voltage. Returns a dict with the
+        # current presence, the number of changes (wraps at 256) and the age of the
+        # last change in seconds (0xFFFF if there has been none), or None.
+        read = self.read_frame(self.REG_POWER_EVENT, struct.calcsize(self._POWER_EVENT_FORMAT))
+        if read is None:
+            return None
+        return dict(zip(self._POWER_EVENT_FIELDS, struct.unpack(self._POWER_EVENT_FORMAT, bytes(read))))
+
+    def get_load_step(self):
+        # reads the battery voltages in mV around the last load step. Returns a dict
+        # with the kind of the step (see LOAD_STEP_*) and the voltage before and
+        # after it, or None.
+        read = self.read_frame(self.REG_LOAD_STEP, struct.calcsize(self._LOAD_STEP_FORMAT))
+        if read is None:
+            return None
+        return dict(zip(self._LOAD_STEP_FIELDS, struct.unpack(self._LOAD_STEP_FORMAT, bytes(read))))
+
+    def get_history(self):
+        # reads the battery voltage history of the firmware. Returns a dict with the
+        # interval between the samples and the age of the newest sample (both in
+        # seconds) and the samples from oldest to newest, or None.
+        data = self.read_stream(self.STREAM_HISTORY)
+        if data is None:
+            return None
+        (interval, age) = struct.unpack_from(self._HISTORY_HEADER_FORMAT, data)
+        header_size = struct.calcsize(self._HISTORY_HEADER_FORMAT)
+        count = (len(data) - header_size) // 2
+        samples = struct.unpack_from('<' + 'H' * count, data, header_size)
+        return {'interval': interval, 'age': age, 'samples': list(samples)}
+
+    def get_eeprom(self):
+        # reads the whole EEPROM of the firmware, returns bytes or None
+        return self.read_stream(self.STREAM_EEPROM)
+
+    def read_stream(self, stream):
+        # reads a stream of the firmware chunk by chunk and returns it as bytes or
+        # None. A chunk received incorrectly is requested again with the retry
+        # register, if the firmware has not seen our read its cursor is moved back.
+        # A chunk refused by the firmware is simply requested again.
+        # Each chunk is retried up to num_retries times.
+        if not self.has_feature(self.FEATURE_STREAMS):
+            logging.warning("The firmware does not support streams.")
+            return None
+        length = self.open_stream(stream)
+        if length is None:
+            return None
+
+        data = b''
+        register = self.REG_STREAM_CHUNK
+        failures = 0
+        while len(data) < length:
+            offset = len(data)
+            chunk = self._read_chunk(register, offset, min(self._STREAM_CHUNK_SIZE, length - offset))
+            if chunk is not None and chunk[0] == offset:
+                data += chunk[1]
+                register = self.REG_STREAM_CHUNK
+                failures = 0
+                continue
+
+            failures += 1
+            if failures > self._num_retries:
+                logging.warning("Couldn't read stream " + str(stream) + " after " +
+                                str(self._num_retries) + " retries.")
+                return None
+            if chunk is None:
+                register = self.REG_STREAM_RETRY
+            elif chunk[0] == self._STREAM_BUSY:
+                # the firmware is writing its EEPROM and has not moved the cursor
+                logging.debug("The chunk at " + str(offset) + " has been refused, the EEPROM is busy.")
+            elif self.open_stream(stream, offset) is None:
+                return None
+            else:
+                register = self.REG_STREAM_CHUNK
+        return data
+
+    def open_stream(self, stream, offset=0):
+        # selects a stream and the offset of its next chunk, returns the length
+        # of the stream or None. The write is confirmed by reading the cursor.
+        data = [stream] + list(struct.pack('<H', offset))
+        data.append(self.calcCRC(self.REG_STREAM_CURSOR, data, len(data)))
+        for x in range(self._num_retries):
+            time.sleep(self._time_const_write)
+            try:
+                self._bus.write_i2c_block_data(self._address, self.REG_STREAM_CURSOR, data)
+                cursor = self.get_stream_cursor()
+                if cursor is not None and cursor[0:2] == (stream, offset):
+                    return cursor[2]
+            except Exception as e:
+                logging.debug("Couldn't select stream " + str(stream) + ". Exception: " + str(e))
+        logging.warning("Couldn't select stream " + str(stream) + " after " + str(self._num_retries) + " retries.")
+        return None
+
+    def get_stream_cursor(self):
+        # reads the cursor, returns a tuple of stream, offset and length or None
+        read = self.read_frame(self.REG_STREAM_CURSOR, struct.calcsize(self._STREAM_CURSOR_FORMAT))
+        if read is None:
+            return None
+        return struct.unpack(self._STREAM_CURSOR_FORMAT, bytes(read))
+
+    def _read_chunk(self, register, offset, size):
+        # reads a chunk of size bytes, returns a tuple of its offset and data or
+        # None if it has not been received correctly
+        time.sleep(self._time_const_read)
+        try:
+            read = self._bus.read_i2c_block_data(self._address, register, size + 4)
+            if read[0] | (read[1] << 8) == self._STREAM_BUSY:
+                # a refused chunk has no data, its CRC follows the offset
+                (crc,) = struct.unpack_from('<H', bytes(read), 2)
+                if crc == self._crc16(register, read[0:2]):
+                    return (self._STREAM_BUSY, b'')
+            (crc,) = struct.unpack_from('<H', bytes(read), size + 2)
+            if crc == self._crc16(register, read[0:size + 2]):
+                return (read[0] | (read[1] << 8), bytes(read[2:size + 2]))
+            logging.debug("Couldn't read chunk at " + str(offset) + " correctly.")
+        except Exception as e:
+            logging.debug("Couldn't read chunk at " + str(offset) + ". Exception: " + str(e))
+        return None
+
+    def _crc16(self, register, data):
+        # CRC-16 (XMODEM) of the register number followed by the data, as data_crc16()
+        # of the firmware
+        return binascii.crc_hqx(bytes([register]) + bytes(data), 0)
+
+    def get_block(self, block):
+        # reads all registers of a block with a single transaction and returns
+        # a dict mapping each register to its value
+        values = self._read_block(block)
+        if values is None:
+            # signal the error the same way as the single register reads
+            values = {reg: 0xFFFF if fmt == 'B' else 0xFFFFFFFF for (reg, fmt) in self._BLOCKS[block]}
+        return values
+
+    def _read_block(self, block):
+        layout = self._BLOCKS[block]
+        block_format = '<' + ''.join(fmt for (reg, fmt) in layout)
+        read = self.read_frame(block, struct.calcsize(block_format))
+        if read is None:
+            return None
+        return dict(zip((reg for (reg, fmt) in layout), struct.unpack(block_format, bytes(read))))
+
+    def get_changed(self):
+        # reads and clears the change bitmap of the firmware. Returns the set of
+        # registers written since the last call or None if the bitmap could not be
+        # read. There is no retry: the firmware clears the bitmap with the first
+        # read, a retry would only return the changes since then.
+        time.sleep(self._time_const_read)
+        try:
+            read = self._bus.read_i2c_block_data(self._address, self.REG_CHANGED, self._CHANGED_SIZE + 1)
+            if read[self._CHANGED_SIZE] == self.calcCRC(self.REG_CHANGED, read, self._CHANGED_SIZE):
+                return {reg for (row, reg) in enumerate(self._TABLE_ROWS)
+                        if read[row >> 3] & (1 << (row & 0x7))}
+            logging.debug("Couldn't read register " + hex(self.REG_CHANGED) + " correctly.")
+        except Exception as e:
+            logging.debug("Couldn't read register " + hex(self.REG_CHANGED) + ". Exception: " + str(e))
+        return None
+
+    def update_values(self, values):
+        # brings a dict mapping registers to values up to date. Only the blocks of
+        # registers that changed (or are missing in values) are read, if nothing
+        # changed this costs a single transaction. Registers that cannot be read are
+        # removed from values, they are read again with the next call. The
+        # measurements are not tracked by the firmware, use get_snapshot() for them.
+        # Returns False if a block could not be read.
+        changed = self.get_changed() if self.has_feature(self.FEATURE_CHANGE_BITMAP) else None
+        if changed is None:
+            changed = set(self._REGISTER_BLOCK)
+        changed |= {reg for reg in self._REGISTER_BLOCK if reg not in values}
+        blocks = {self._REGISTER_BLOCK[reg] for reg in changed if reg in self._REGISTER_BLOCK}
+
+        success = True
+        for block in blocks:
+            read = self._read_block(block)
+            if read is None:
+                for (reg, fmt) in self._BLOCKS[block]:
+                    values.pop(reg, None)
+                success = False
+            else:
+                values.update(read)
+        logging.debug("Read " + str(len(blocks)) + " changed register blocks")
+        return success
+
+    def read_frame(self, register, length):
+        # reads length bytes of data followed by the crc, returns the data or None
+        for x in range(self._num_retries):
+            time.sleep(self._time_const_read)
+            try:
+                read = self._bus.read_i2c_block_data(self._address, register, length + 1)
+                if read[length] == self.calcCRC(register, read, length):
+                    return read[0:length]
+                logging.debug("Couldn't read register " + hex(register) + " correctly.")
+            except Exception as e:
+                logging.debug("Couldn't read register " + hex(register) + ". Exception: " + str(e))
+        logging.warning("Couldn't read register " + hex(register) + " after " + str(self._num_retries) + " retries.")
+        return None
@@ -0,0 +1,88 @@
+#!/usr/bin/env python3
+
+import sys
+
+sys.path.append('/opt/attiny_daemon/')  # add the path to our ATTiny module
+
+import random
+import timeit
+import logging
+from attiny_i2c import ATTiny
+
+# compares the CRC implementations of the daemon and the firmware and measures the
+# time needed per frame on this machine, no ATTiny is needed for this
+
+_num_frames = 10000 # the number of random frames used for comparison and timing
+_frame_length = 4   # the data length of a frame, the version register is the longest read
+_repeat = 5         # timing runs, the best one is reported
+
+# the nibble table of the firmware (handleCRC.ino)
+_nibble_table = (0x00, 0x31, 0x62, 0x53, 0xC4, 0xF5, 0xA6, 0x97,
+                 0xB9, 0x88, 0xDB, 0xEA, 0x7D, 0x4C, 0x1F, 0x2E)
+
+def crc_reference(attiny, register, data):
+    crc = attiny.addCrc(0, register)
+    for elem in data:
+        crc = attiny.addCrc(crc, elem)
+    return crc
+
+def crc_table(attiny, register, data):
+    return attiny.calcCRC(register, data, len(data))
+
+def crc_firmware_nibble(attiny, register, data):
+    crc = 0
+    for elem in [register] + data:
+        crc ^= elem
+        crc = ((crc << 4) & 0xFF) ^ _nibble_table[crc >> 4]
+        crc = ((crc << 4) & 0xFF) ^ _nibble_table[crc >> 4]
+    return crc
+
+def crc_firmware_bitwise(attiny, register, data):
+    # the original bit-serial firmware implementation (crc8_bytecalc) which
+    # needs to be continued with a 0 byte at the end
+    def bytecalc(data, reg):
+        for bitnumber in range(0, 8):
+            flag = reg & 0x80
+            reg = ((reg << 1) | ((data >> 7) & 0x01)) & 0xFF
+            if flag:
+                reg ^= ATTiny._POLYNOME
+            data = (data << 1) & 0xFF
+        return reg
+    crc = 0
+    for elem in [register] + data:
+        crc = bytecalc(elem, crc)
+    return bytecalc(0, crc)
+
+# set up logging
+root_log = logging.getLogger()
+root_log.setLevel("INFO")
+
+# no bus is needed, only the CRC methods are used
+attiny = ATTiny(None, 0, 0, 0)
+
+frames = []
+for x in range(_num_frames):
+    frames.append((random.randrange(256), [random.randrange(256) for y in range(_frame_length)]))
+
+implementations = (("reference", crc_reference), ("table", crc_table),
+                   ("firmware nibble", crc_firmware_nibble),
+                   ("firmware bitwise", crc_firmware_bitwise))
+
+# all implementations have to agree before the timing means anything
+failed = False
+for (register, data) in frames:
+    expected = crc_reference(attiny, register, data)
+    for (name, func) in implementations:
+        if func(attiny, register, data) != expected:
+            logging.error("Implementation " + name + " differs for register " + hex(register) +
+                          " and data " + str(data))
+            failed = True
+            break
+if failed:
+    sys.exit(1)
+logging.info("All implementations agree on " + str(_num_frames) + " frames")
+
+for (name, func) in implementations:
+    run = lambda: [func(attiny, register, data) for (register, data) in frames]
+    best = min(timeit.repeat(run, number=1, repeat=_repeat))
+    logging.info("{:<17} {:6.2f} us per frame".format(name, best * 1000000 / _num_frames))
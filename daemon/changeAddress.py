@@ -0,0 +1,40 @@
+#!/usr/bin/env python3
+
+import sys
+
+sys.path.append('/opt/attiny_daemon/')  # add the path to our ATTiny module
+
+import smbus
+import logging
+from attiny_i2c import ATTiny
+
+_time_const = 0.7   # used as a pause between i2c communications, the ATTiny is slow
+_num_retries = 10   # the number of retries when reading from or writing to the ATTiny_Daemon
+
+# changes the I2C address of an ATTiny_Daemon, the new address is stored in its EEPROM.
+# Usage: changeAddress.py <current address> <new address>, e.g. changeAddress.py 0x37 0x38
+# Stop the daemon before and change the 'i2c address' in its config file afterwards.
+
+# set up logging
+root_log = logging.getLogger()
+root_log.setLevel("INFO")
+
+if len(sys.argv) != 3:
+    logging.error("Usage: " + sys.argv[0] + " <current address> <new address>")
+    sys.exit(1)
+
+old_address = int(sys.argv[1], 0)
+new_address = int(sys.argv[2], 0)
+if new_address < 0x08 or new_address > 0x77:
+    logging.error("The address has to be between 0x08 and 0x77")
+    sys.exit(1)
+
+# set up communication to the ATTiny_Daemon
+bus = smbus.SMBus(1)
+attiny = ATTiny(bus, old_address, _time_const, _num_retries)
+
+if attiny.set_i2c_address(new_address):
+    logging.info("The ATTiny_Daemon now uses address " + hex(new_address))
+else:
+    logging.error("Couldn't change the address of the ATTiny_Daemon at " + hex(old_address))
+    sys.exit(1)
@@ -0,0 +1,42 @@
+#!/usr/bin/env python3
+
+import sys
+
+sys.path.append('/opt/attiny_daemon/')  # add the path to our ATTiny module
+
+import smbus
+import logging
+from attiny_i2c import ATTiny
+
+_time_const = 0.7   # used as a pause between i2c communications, the ATTiny is slow
+_num_retries = 10   # the number of retries when reading from or writing to the ATTiny_Daemon
+_i2c_address = 0x37 # the I2C address that is used for the ATTiny_Daemon
+
+# prints the battery voltage history kept by the ATTiny_Daemon, the newest sample last.
+# With the argument "eeprom" the content of its EEPROM is dumped instead.
+
+# set up logging
+root_log = logging.getLogger()
+root_log.setLevel("INFO")
+
+# set up communication to the ATTiny_Daemon
+bus = smbus.SMBus(1)
+attiny = ATTiny(bus, _i2c_address, _time_const, _num_retries)
+attiny.discover()
+
+if len(sys.argv) > 1 and sys.argv[1] == "eeprom":
+    eeprom = attiny.get_eeprom()
+    if eeprom is None:
+        sys.exit(1)
+    for address in range(0, len(eeprom), 16):
+        logging.info("{:03x}: ".format(address) + ' '.join('{:02x}'.format(b) for b in eeprom[address:address + 16]))
+    sys.exit(0)
+
+history = attiny.get_history()
+if history is None:
+    sys.exit(1)
+count = len(history['samples'])
+logging.info(str(count) + " samples, one every " + str(history['interval']) + " seconds")
+for (index, sample) in enumerate(history['samples']):
+    age = history['age'] + (count - 1 - index) * history['interval']
+    logging.info("{:6d} seconds ago: {:5d} mV".format(age, sample))
@@ -31,12 +31,17 @@ states = {
     32 : "SHUTDOWN_STATE",
 }
 
-state = attiny.get_internal_state()
-logging.info("Current state is " + hex(state) + ": " + states[state])
+# the live values are read with a single transaction
+snapshot = attiny.get_snapshot()
+
+state = snapshot['internal_state']
+logging.info("Current state is " + hex(state) + ": " + states.get(state, "UNKNOWN"))
 
 # access data
-logging.info("Current battery voltage is " + str(attiny.get_bat_voltage() / 1000) + "V.")
-logging.info("Current external voltage is " + str(attiny.get_ext_voltage() / 1000) + "V.")
+logging.info("Current battery voltage is " + str(snapshot['bat_voltage'] / 1000) + "V.")
+if snapshot['state_of_charge'] <= 100:
+    logging.info("Current state of charge is " + str(snapshot['state_of_charge']) + "%.")
+logging.info("Current external voltage is " + str(snapshot['ext_voltage'] / 1000) + "V.")
 
 logging.info("Current warn voltage is " + str(attiny.get_warn_voltage() / 1000) + "V.")
 logging.info("Current shutdown voltage is " + str(attiny.get_shutdown_voltage() / 1000) + "V.")
@@ -0,0 +1,76 @@
+#!/usr/bin/python3
+
+import struct
+import sys
+import types
+import unittest
+
+# the tests run without an I2C bus
+smbus = types.ModuleType('smbus')
+smbus.SMBus = lambda bus: None
+sys.modules.setdefault('smbus', smbus)
+
+from attiny_i2c import ATTiny
+from attiny_daemon import log_time_left
+
+
+class FakeBus:
+    # answers reads like the firmware, every register holds the value in regs. The
+    # bytes are the two's complement of the value, whatever format the daemon uses.
+    def __init__(self, regs):
+        self.regs = regs
+        self.crc = ATTiny(None, 0, 0, 1)
+
+    def encode(self, fmt, value):
+        size = struct.calcsize('<' + fmt)
+        return list((value & ((1 << (8 * size)) - 1)).to_bytes(size, byteorder='little'))
+
+    def read_i2c_block_data(self, address, register, length):
+        if register == ATTiny.REG_SNAPSHOT:
+            fields = zip(ATTiny._SNAPSHOT_FORMAT[1:], ATTiny._SNAPSHOT_FIELDS)
+            data = [b for (fmt, field) in fields for b in self.encode(fmt, self.regs.get(field, 0))]
+        elif register in ATTiny._BLOCKS:
+            data = [b for (reg, fmt) in ATTiny._BLOCKS[register] for b in self.encode(fmt, self.regs.get(reg, 0))]
+        else:
+            data = self.encode(ATTiny._FORMATS[register], self.regs[register])
+        data.append(self.crc.calcCRC(register, data, len(data)))
+        return data[0:length]
+
+
+class TestTimeToEmpty(unittest.TestCase):
+    def attiny(self, warn, shutdown):
+        bus = FakeBus({ATTiny.REG_TIME_TO_WARN: warn, ATTiny.REG_TIME_TO_SHUTDOWN: shutdown})
+        return ATTiny(bus, 0x37, 0, 1)
+
+    def test_unknown(self):
+        attiny = self.attiny(ATTiny.RUNTIME_UNKNOWN, ATTiny.RUNTIME_UNKNOWN)
+        self.assertEqual(attiny.get_time_to_warn(), ATTiny.RUNTIME_UNKNOWN)
+        self.assertEqual(attiny.get_time_to_shutdown(), ATTiny.RUNTIME_UNKNOWN)
+
+    def test_above_32767_seconds(self):
+        attiny = self.attiny(32768, 0xFFFE)
+        self.assertEqual(attiny.get_time_to_warn(), 32768)
+        self.assertEqual(attiny.get_time_to_shutdown(), 0xFFFE)
+
+    def test_log_unknown(self):
+        attiny = self.attiny(ATTiny.RUNTIME_UNKNOWN, 600)
+        with self.assertLogs(level='INFO') as logs:
+            log_time_left(attiny.get_time_to_warn(), "the warn voltage")
+            log_time_left(attiny.get_time_to_shutdown(), "the shutdown voltage")
+        self.assertEqual(logs.output, ["INFO:root:The time until the warn voltage is not known yet.",
+                                       "INFO:root:About 10 minutes until the shutdown voltage."])
+
+
+class TestTemperature(unittest.TestCase):
+    def test_below_zero(self):
+        bus = FakeBus({ATTiny.REG_TEMPERATURE: -5, 'temperature': -5, ATTiny.REG_T_CONSTANT: -270})
+        attiny = ATTiny(bus, 0x37, 0, 1)
+        self.assertEqual(attiny.get_temperature(), -5)
+        block = attiny.get_block(ATTiny.REG_BLOCK_TEMPERATURE)
+        self.assertEqual(block[ATTiny.REG_TEMPERATURE], -5)
+        self.assertEqual(block[ATTiny.REG_T_CONSTANT], -270)
+        self.assertEqual(attiny.get_snapshot()['temperature'], -5)
+
+
+if __name__ == '__main__':
+    unittest.main()
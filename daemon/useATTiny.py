@@ -21,29 +21,36 @@ root_log.setLevel("INFO")
 bus = smbus.SMBus(1)
 attiny = ATTiny(bus, _i2c_address, _time_const, _num_retries)
 
-# access data
-(major, minor, patch) = attiny.get_version()
-version = str(major) + "." + str(minor) + "." + str(patch)
+# access data, every block is read with a single transaction
+identity = attiny.get_block(ATTiny.REG_BLOCK_IDENTITY)
+voltages = attiny.get_block(ATTiny.REG_BLOCK_VOLTAGES)
+control = attiny.get_block(ATTiny.REG_BLOCK_CONTROL)
+thresholds = attiny.get_block(ATTiny.REG_BLOCK_THRESHOLDS)
+temperature = attiny.get_block(ATTiny.REG_BLOCK_TEMPERATURE)
+reset = attiny.get_block(ATTiny.REG_BLOCK_RESET)
+
+prog_version = identity[ATTiny.REG_VERSION]
+version = str((prog_version >> 16) & 0xFF) + "." + str((prog_version >> 8) & 0xFF) + "." + str(prog_version & 0xFF)
 logging.info("Current Version is " + version)
 
-logging.info("Current temperature is " + str(attiny.get_temperature()) + " degrees Celsius.")
+logging.info("Current temperature is " + str(temperature[ATTiny.REG_TEMPERATURE]) + " degrees Celsius.")
 
-logging.info("Current battery voltage is " + str(attiny.get_bat_voltage() / 1000) + "V.")
-logging.info("Current external voltage is " + str(attiny.get_ext_voltage() / 1000) + "V.")
+logging.info("Current battery voltage is " + str(voltages[ATTiny.REG_BAT_VOLTAGE] / 1000) + "V.")
+logging.info("Current external voltage is " + str(voltages[ATTiny.REG_EXT_VOLTAGE] / 1000) + "V.")
 
-logging.info("Current timeout is " + str(attiny.get_timeout()))
-logging.info("Current primed is " + str(attiny.get_primed()))
-logging.info("Current force_shutdown is " + str(attiny.get_force_shutdown()))
+logging.info("Current timeout is " + str(control[ATTiny.REG_TIMEOUT]))
+logging.info("Current primed is " + str(control[ATTiny.REG_PRIMED]))
+logging.info("Current force_shutdown is " + str(control[ATTiny.REG_FORCE_SHUTDOWN]))
 
-logging.info("Current warn voltage is " + str(attiny.get_warn_voltage() / 1000) + "V.")
-logging.info("Current shutdown voltage is " + str(attiny.get_shutdown_voltage() / 1000) + "V.")
-logging.info("Current restart voltage is " + str(attiny.get_restart_voltage() / 1000) + "V.")
+logging.info("Current warn voltage is " + str(thresholds[ATTiny.REG_WARN_VOLTAGE] / 1000) + "V.")
+logging.info("Current shutdown voltage is " + str(thresholds[ATTiny.REG_SHUTDOWN_VOLTAGE] / 1000) + "V.")
+logging.info("Current restart voltage is " + str(thresholds[ATTiny.REG_RESTART_VOLTAGE] / 1000) + "V.")
 
-logging.info("Current reset configuration is " + str(attiny.get_reset_configuration()))
-logging.info("Current reset pulse length is " + str(attiny.get_reset_pulse_length()))
-logging.info("Current switch recovery delay is " + str(attiny.get_switch_recovery_delay()))
+logging.info("Current reset configuration is " + str(reset[ATTiny.REG_RESET_CONFIG]))
+logging.info("Current reset pulse length is " + str(reset[ATTiny.REG_RESET_PULSE_LENGTH]))
+logging.info("Current switch recovery delay is " + str(reset[ATTiny.REG_SW_RECOVERY_DELAY]))
 
 
-logging.info("Low fuse is " + hex(attiny.get_fuse_low()))
-logging.info("High fuse is " + hex(attiny.get_fuse_high()))
-logging.info("Extended fuse is " + hex(attiny.get_fuse_extended()))
+logging.info("Low fuse is " + hex(identity[ATTiny.REG_FUSE_LOW]))
+logging.info("High fuse is " + hex(identity[ATTiny.REG_FUSE_HIGH]))
+logging.info("Extended fuse is " + hex(identity[ATTiny.REG_FUSE_EXTENDED]))
@@ -1,5 +1,6 @@
 #include <USIWire.h>
 #include <util/atomic.h>
+#include <util/crc16.h>
 #include <EEPROM.h>
 #include <limits.h>
 #include <avr/io.h>
@@ -8,6 +9,8 @@
 #include <avr/sleep.h>
 #include <avr/wdt.h>
 
+#include "filters.h"
+
 /*
    Flash size definition
    used to decide which implementation fits into the flash
@@ -40,6 +43,7 @@ const uint8_t PIN_SWITCH        =   PB1;    // pin used for pushing the switch (
 const uint8_t PIN_RESET         =   PB5;    // Reset pin (used as an alternative direct way to reset the RPi)
 // The following pin definition is needed as a define statement to allow the macro expansion in handleVoltages.ino
 #define EXT_VOLTAGE                ADC3    // ADC number, used to measure external or RPi voltage (Ax, ADCx or x)
+const uint8_t PIN_EXT_VOLTAGE   =   PB3;    // the pin of EXT_VOLTAGE, watched by a pin change interrupt for power loss
 
 /*
    Basic constants
@@ -48,6 +52,91 @@ const uint8_t  BLINK_TIME       =    100;  // time in milliseconds for the LED t
 const uint16_t MIN_POWER_LEVEL  =   4750;  // the voltage level seen as "ON" at the external voltage after a reset
 const uint8_t  NUM_MEASUREMENTS =      5;  // the number of ADC measurements we average, should be larger than 4
 
+/*
+   Oversampling, the oversampling register holds a 2 bit ratio for each ADC
+   channel. A ratio of n takes 4^n conversions and decimates their sum by n
+   bits, i.e. 4x, 16x or 64x gain 1, 2 or 3 bits of resolution. 0 uses the
+   trimmed average of NUM_MEASUREMENTS conversions instead. read_adc() always
+   returns ADC_BITS bit values (the raw domain), the ratio of a channel does not
+   change its scale.
+*/
+const uint8_t  OVERSAMPLING_BAT_VOLTAGE =  0;  // the position of the ratio of each channel
+const uint8_t  OVERSAMPLING_EXT_VOLTAGE =  2;
+const uint8_t  OVERSAMPLING_TEMPERATURE =  4;
+const uint8_t  OVERSAMPLING_MASK        = 0x3F;
+const uint8_t  OVERSAMPLING_MAX         =  3;  // 64x
+const uint8_t  OVERSAMPLING_WARN_MAX    =  2;  // 16x, the budget in the warn state
+const uint8_t  ADC_BITS                 = 16;
+const uint8_t  SETTLE_CONVERSIONS       = 10;  // conversions thrown away while the band gap settles, about 1.1ms
+const uint8_t  TEMPERATURE_INTERVAL     =  8;  // the temperature is measured with every 8th measurement
+
+/*
+   Sampling profiles, selected with the sampling_profile register. The fixed
+   profile measures on every wake. The adaptive profile measures rarely and
+   with few conversions while the battery voltage is stable or rising and
+   measures on every wake (waking every second in the warn state) while it
+   falls or is near the warn voltage, see handleSampling.ino.
+*/
+namespace Sampling_Profile {
+enum Sampling_Profile {
+  fixed                         = 0,
+  adaptive                      = 1,
+};
+}
+
+const uint8_t  CALM_SAMPLE_INTERVAL     =  8;  // seconds between two measurements while the battery is stable
+const uint8_t  CALM_MEASUREMENTS        =  3;  // conversions per channel while the battery is stable
+const uint8_t  SLOPE_WINDOW             = 64;  // seconds over which the slope of the battery voltage is taken
+const uint16_t SLOPE_DISCHARGE          = 32;  // rise of the band gap reading within SLOPE_WINDOW seen as discharge (about 5mV)
+const uint8_t  WARN_MARGIN_SHIFT        =  5;  // near the warn voltage means less than 1/32 (about 100mV) above it
+
+/*
+   The state of charge is looked up in a discharge curve of a typical Li-ion
+   cell (see handleBattery.ino). A cold cell delivers its charge at a lower
+   voltage, below SOC_REFERENCE_TEMPERATURE the voltage is raised by
+   SOC_COLD_COMPENSATION mV per degree before the lookup (0 turns this off).
+*/
+struct Charge_Point {
+  uint16_t millivolts;
+  uint8_t  percent;
+} __attribute__ ((__packed__));
+
+const uint8_t  SOC_UNKNOWN               = 0xFF;  // the state of charge before the first measurement
+const int16_t  SOC_REFERENCE_TEMPERATURE =   20;  // the temperature of the discharge curve in degrees
+const uint8_t  SOC_COLD_COMPENSATION     =    2;  // mV per degree below SOC_REFERENCE_TEMPERATURE
+
+/*
+   The time until the battery reaches the warn and shutdown voltage is
+   predicted from the slope of a least squares line through the last
+   RUNTIME_SAMPLES battery voltages, one taken every RUNTIME_INTERVAL seconds
+   (see handleBattery.ino).
+*/
+const uint8_t  RUNTIME_SAMPLES           =   16;  // the samples of the regression, about 8 minutes
+const uint8_t  RUNTIME_INTERVAL          =   30;  // the seconds between two samples
+const uint16_t RUNTIME_SLOPE_DIVISOR     = (uint16_t)RUNTIME_SAMPLES * (RUNTIME_SAMPLES * RUNTIME_SAMPLES - 1) / 6;
+const uint16_t RUNTIME_UNKNOWN           = 0xFFFF;  // not discharging or not enough samples yet
+
+/*
+   The health of the battery is estimated from the voltage sag at the load
+   steps we cause or see (see handleBattery.ino). The sag of a step is a proxy
+   of the internal resistance, the current drawn by the Raspberry is about the
+   same each time.
+*/
+namespace Load_Step_Kind {
+enum Load_Step_Kind {
+  none                          = 0,
+  ups_on                        = 1,       // the Raspberry has been switched on, the voltage sags
+  ups_off                       = 2,       // the Raspberry has been switched off, the voltage recovers
+  power_loss                    = 3,       // the external voltage has been lost
+};
+}
+
+const uint16_t LOAD_STEP_DELAY           =  500;  // ms after the step until the voltage is measured again
+const uint8_t  LOAD_STEP_MIN             =   10;  // mV, smaller steps are no load step (e.g., the Raspberry was already on)
+const uint8_t  SAG_AVERAGE_SHIFT         =    2;  // every sag is weighted with 1/4 in sag_average
+const uint8_t  SAG_REFERENCE_MIN         =   20;  // mV, the smallest sag_reference used to calculate the health
+const uint8_t  HEALTH_UNKNOWN            = 0xFF;  // no load step has been seen yet
+
 
 /*
    Values modelling the different states the system can be in
@@ -88,6 +177,17 @@ enum EEPROM_Address {
   reset_pulse_length            = 23,      // uint16_t
   switch_recovery_delay         = 25,      // uint16_t
   led_off_mode                  = 27,      // uint8_t
+  notify                        = 28,      // uint8_t
+  i2c_address                   = 29,      // uint16_t
+  oversampling                  = 31,      // uint8_t
+  bat_process_noise             = 32,      // uint16_t
+  bat_measurement_noise         = 34,      // uint16_t
+  temperature_alpha             = 36,      // uint8_t
+  sampling_profile              = 37,      // uint8_t
+  sag_reference                 = 38,      // uint16_t
+  sag_average                   = 40,      // uint16_t
+
+  none                          = 0xFF,    // used in the register table for registers that are not persisted
 } __attribute__ ((__packed__));            // force smallest size i.e., uint_8t (GCC syntax)
 }
 
@@ -96,7 +196,8 @@ const uint8_t EEPROM_INIT_VALUE = 0x42;
 /*
    I2C interface and register definitions
 */
-const uint8_t I2C_ADDRESS       = 0x37;
+const uint8_t I2C_ADDRESS       = 0x37;  // the default address, the address in use is stored in the EEPROM
+const uint16_t GUARDED_I2C_ADDRESS = I2C_ADDRESS | ((uint8_t)~I2C_ADDRESS << 8);  // the default address and its complement
 
 enum class Register : uint8_t {
   last_access                   = 0x01,
@@ -106,29 +207,266 @@ enum class Register : uint8_t {
   bat_voltage_constant          = 0x14,
   ext_voltage_coefficient       = 0x15,
   ext_voltage_constant          = 0x16,
+  oversampling                  = 0x17,    // the oversampling ratio of each ADC channel, see OVERSAMPLING_MASK
+  state_of_charge               = 0x18,    // the remaining capacity of the battery in percent, see update_state_of_charge()
   timeout                       = 0x21,
   primed                        = 0x22,
   should_shutdown               = 0x23,
   force_shutdown                = 0x24,
   led_off_mode                  = 0x25,
+  notify                        = 0x26,
   restart_voltage               = 0x31,
   warn_voltage                  = 0x32,
   shutdown_voltage              = 0x33,
+  time_to_warn                  = 0x34,    // the seconds until the battery reaches warn_voltage, see sample_runtime()
+  time_to_shutdown              = 0x35,    // the seconds until the battery reaches shutdown_voltage
   temperature                   = 0x41,
   temperature_coefficient       = 0x42,
   temperature_constant          = 0x43,
   reset_configuration           = 0x51,
   reset_pulse_length            = 0x52,
   switch_recovery_delay         = 0x53,
+  bat_process_noise             = 0x61,    // the parameters of the filters, see filters.h
+  bat_measurement_noise         = 0x62,
+  temperature_alpha             = 0x63,
+  sampling_profile              = 0x64,    // see Sampling_Profile
+  sag_reference                 = 0x71,    // the voltage sag of the new battery, see update_health()
+  sag_average                   = 0x72,    // the average voltage sag at the load steps
+  battery_health                = 0x73,    // 100 for a new battery, 0 when the sag has doubled
   version                       = 0x80,
   fuse_low                      = 0x81,
   fuse_high                     = 0x82,
   fuse_extended                 = 0x83,
   internal_state                = 0x84,
+  eeprom_pending                = 0x85,
+  i2c_address                   = 0x86,    // the I2C address followed by its complement, see valid_I2C_address()
+  snapshot                      = 0x90,
+  changed                       = 0x91,    // bitmap of the registers changed since the last read, see take_changed()
+  link_counters                 = 0x92,    // I2C error counters, see struct Link_Counters
+  features                      = 0x93,    // number of registers and Feature bits, see struct Features
+  write_status                  = 0x94,    // the result of the last write, see struct Write_Status
+  power_event                   = 0x95,    // the last loss or return of the external voltage, see struct Power_Event
+  load_step                     = 0x96,    // the voltages around the last load step, see struct Load_Step
+  block_voltages                = 0xB1,    // burst read of 0x11 - 0x18
+  block_control                 = 0xB2,    // burst read of 0x21 - 0x26
+  block_thresholds              = 0xB3,    // burst read of 0x31 - 0x35
+  block_temperature             = 0xB4,    // burst read of 0x41 - 0x43
+  block_reset                   = 0xB5,    // burst read of 0x51 - 0x53
+  block_filters                 = 0xB6,    // burst read of 0x61 - 0x64
+  block_battery                 = 0xB7,    // burst read of 0x71 - 0x73
+  block_identity                = 0xB8,    // burst read of 0x80 - 0x86
+  stream_cursor                 = 0xC0,    // select a stream and offset, see struct Stream_Cursor
+  stream_chunk                  = 0xC1,    // the next chunk of the stream, see write_stream_chunk()
+  stream_retry                  = 0xC2,    // the last chunk again
+  descriptors                   = 0xD0,    // pages 0xD0 - 0xDF of the register table, see write_descriptor_page()
 
+  batch_write                   = 0xF0,    // write several registers atomically, see write_batch()
   init_eeprom                   = 0xFF,
 }; // __attribute__ ((__packed__));            // force smallest size i.e., uint_8t (GCC syntax)
 
+const uint8_t BLOCK_REGISTER_BASE = 0xB0;  // block_* registers are BLOCK_REGISTER_BASE | high nibble of the block
+const uint8_t DESCRIPTOR_REGISTER_BASE = 0xD0;  // page n of the register table is read with DESCRIPTOR_REGISTER_BASE | n
+const uint8_t DESCRIPTORS_PER_PAGE = 6;    // two bytes per register, a page fits into the transmit buffer
+
+/*
+   The register table (see handleRegisters.ino) describes each register with
+   the following flags, the lowest three bits hold the size in bytes.
+*/
+namespace Register_Flag {
+enum Register_Flag {
+  size_mask                     = 0x07,    // size of the register in bytes (1, 2 or 4)
+  is_signed                     = bit(3),  // the value is a signed integer
+  writable                      = bit(4),  // the register can be written over I2C
+  persisted                     = bit(5),  // the register is stored in the EEPROM (only in the descriptor pages)
+  readable                      = bit(6),  // the register can be read (only in the descriptor pages)
+} __attribute__ ((__packed__));            // force smallest size i.e., uint_8t (GCC syntax)
+}
+
+/*
+   Actions executed after a register has been written
+*/
+namespace Register_Hook {
+enum Register_Hook {
+  none                          = 0,
+  reset_bat_average             = 1,       // restart averaging the battery voltage
+  init_eeprom                   = 2,       // write all persisted registers to the EEPROM
+  i2c_address                   = 3,       // switch to the new I2C address, the value is checked before
+  thresholds                    = 4,       // convert the voltage thresholds to the raw domain again
+  calibration                   = 5,       // calculate the multipliers of the calibration again
+  battery_health                = 6,       // calculate the battery health again
+} __attribute__ ((__packed__));            // force smallest size i.e., uint_8t (GCC syntax)
+}
+
+const uint8_t MAX_REGISTERS = 64;         // maximum number of rows in the register table (size of the bitmaps)
+const uint8_t NO_ROW        = 0xFF;       // returned by find_register() for unknown registers
+
+struct Register_Descriptor {
+  Register reg;                            // the register number
+  uint8_t  flags;                          // size and Register_Flag
+  void     *data;                          // the variable holding the value, nullptr if there is none
+  uint8_t  eeprom;                         // the EEPROM_Address, EEPROM_Address::none if not persisted
+  uint8_t  hook;                           // the Register_Hook executed after a write
+};
+
+
+/*
+   A coefficient and a constant of the registers converted to a fixed-point
+   multiplier, value * coefficient / divisor + constant is calculated as
+   (value * multiplier >> shift) + constant (see fixed_point()). The
+   multiplier keeps 16 significant bits, the error is below 1 in the result.
+*/
+struct Calibration {
+  uint16_t multiplier;
+  uint8_t  shift;
+  int16_t  constant;
+};
+
+
+/*
+   The layout of the snapshot register, all live telemetry in one frame. The
+   order and sizes have to match ATTiny.get_snapshot() on the Raspberry side.
+*/
+struct Snapshot {
+  uint16_t bat_voltage;
+  uint16_t ext_voltage;
+  int16_t  temperature;
+  uint16_t seconds;
+  uint8_t  state;
+  uint8_t  should_shutdown;
+  uint8_t  state_of_charge;
+} __attribute__ ((__packed__));
+
+
+/*
+   The features register tells the Raspberry which registers beyond the
+   register table this firmware supports.
+*/
+namespace Feature {
+enum Feature {
+  snapshot                      = bit(0),  // Register::snapshot
+  change_bitmap                 = bit(1),  // Register::changed
+  link_counters                 = bit(2),  // Register::link_counters
+  block_read                    = bit(3),  // the block_* registers
+  batch_write                   = bit(4),  // Register::batch_write
+  host_notify                   = bit(5),  // SMBus Host Notify, enabled with Register::notify
+  write_status                  = bit(6),  // Register::write_status
+  streams                       = bit(7),  // the stream_* registers
+  power_events                  = bit(8),  // Register::power_event
+  load_steps                    = bit(9),  // Register::load_step
+};
+}
+
+const uint16_t FEATURES = Feature::snapshot | Feature::change_bitmap | Feature::link_counters
+                          | Feature::block_read | Feature::batch_write | Feature::host_notify
+                          | Feature::write_status | Feature::streams | Feature::power_events
+                          | Feature::load_steps;
+
+/*
+   The layout of the features register, the order and sizes have to match
+   ATTiny.discover() on the Raspberry side.
+*/
+struct Features {
+  uint8_t  registers;                      // the number of rows of the register table
+  uint16_t features;                       // Feature bits
+} __attribute__ ((__packed__));
+
+
+/*
+   The layout of the link_counters register. The counters saturate at 0xFFFF
+   and are only reset by a reset of the ATTiny. The order and sizes have to
+   match ATTiny.get_link_counters() on the Raspberry side.
+*/
+struct Link_Counters {
+  uint16_t transactions;                   // all I2C transactions (writes and reads)
+  uint16_t crc_errors;                     // writes dropped because of a wrong CRC
+  uint16_t oversize;                       // writes longer than the receive buffer
+  uint16_t unknown_register;               // accesses to unknown registers and rejected writes, see Write_Result
+  uint16_t read_without_register;          // reads not preceded by a register number
+};                                         // not packed, it only holds 16 bit counters
+
+
+/*
+   The result codes of a write, they are latched in the write_status register
+   together with the register written and a sequence number. The values have
+   to match the WRITE_* constants on the Raspberry side.
+*/
+namespace Write_Result {
+enum Write_Result {
+  applied                       = 0,       // the value has been written
+  crc_mismatch                  = 1,       // the frame has been dropped because of a wrong CRC
+  unknown_register              = 2,       // there is no such register
+  read_only                     = 3,       // the register cannot be written
+  wrong_size                    = 4,       // the data does not match the size of the register
+  out_of_range                  = 5,       // the value has been rejected, see valid_value()
+  oversize                      = 6,       // the frame was longer than the receive buffer
+};
+}
+
+/*
+   The layout of the write_status register. The sequence number is incremented
+   with every write frame received, so the Raspberry can tell whether the
+   status belongs to its own write.
+*/
+struct Write_Status {
+  uint8_t  reg;                            // the register number of the last write frame
+  uint8_t  result;                         // a Write_Result
+  uint8_t  sequence;                       // incremented with each write frame
+};
+
+/*
+   The layout of the power_event register, the last change of the external
+   voltage seen by the pin change interrupt (see handleIO.ino).
+*/
+struct Power_Event {
+  uint8_t  present;                        // 1 if the external voltage is present
+  uint8_t  events;                         // incremented with each loss or return, wraps
+  uint16_t age;                            // seconds since the last event, saturates at 0xFFFF
+} __attribute__ ((__packed__));
+
+/*
+   The layout of the load_step register, the battery voltage in mV before
+   and LOAD_STEP_DELAY after the last load step (see handleBattery.ino).
+*/
+struct Load_Step {
+  uint8_t  kind;                           // a Load_Step_Kind
+  uint16_t before;
+  uint16_t after;
+} __attribute__ ((__packed__));
+
+
+/*
+   The streams that can be read in chunks, see handleStream.ino. The values
+   have to match the STREAM_* constants on the Raspberry side.
+*/
+namespace Stream_Id {
+enum Stream_Id {
+  history                       = 0,       // the battery voltage history
+  eeprom                        = 1,       // the content of the EEPROM
+  count                         = 2,       // the number of streams
+};
+}
+
+/*
+   The layout of the stream_cursor register. It is written with stream and
+   offset only, the length is read-only. The order and sizes have to match
+   ATTiny.get_stream_cursor() on the Raspberry side.
+*/
+struct Stream_Cursor {
+  uint8_t  stream;                         // a Stream_Id
+  uint16_t offset;                         // the offset of the next chunk
+  uint16_t length;                         // the length of the stream when it was selected
+} __attribute__ ((__packed__));
+
+/*
+   A chunk consists of its offset, up to STREAM_CHUNK_SIZE bytes of data and
+   a CRC-16, so it fits into the 16 byte USI transmit buffer. A chunk of the
+   EEPROM refused while it is written has the offset STREAM_BUSY and no data.
+*/
+const uint8_t  STREAM_CHUNK_SIZE        = 12;
+const uint16_t STREAM_BUSY              = 0xFFFF;  // beyond the end of every stream
+const uint8_t  HISTORY_SIZE             = 32;    // the number of battery voltage samples kept
+const uint16_t HISTORY_INTERVAL         = 300;   // the seconds between two samples
+
 
 /*
    The shutdown levels
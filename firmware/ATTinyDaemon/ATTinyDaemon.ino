@@ -8,10 +8,11 @@
 
 /*
    Our version number - used by the daemon to ensure that the major number is equal between firmware and daemon
+   and to warn about a different minor number, which changes with the register protocol
 */
 const uint32_t MAJOR = 2;
-const uint32_t MINOR = 9;
-const uint32_t PATCH = 15;
+const uint32_t MINOR = 10;
+const uint32_t PATCH = 0;
 
 const uint32_t prog_version = (MAJOR << 16) | (MINOR << 8) | PATCH;
 
@@ -56,6 +57,13 @@ uint8_t should_shutdown          = Shutdown_Cause::none;
 uint8_t force_shutdown           =    0;  // != 0, force shutdown if below shutdown_voltage
 uint8_t reset_configuration      =    0;  // bit 0 (0 = 1 / 1 = 2) pulses, bit 1 (0 = don't check / 1 = check) external voltage (only if 2 pulses)
 uint8_t led_off_mode             =    0;  // 0 LED behaves normally, 1 LED does not blink
+uint8_t notify                   =    0;  // != 0, send an SMBus Host Notify when should_shutdown changes
+uint8_t oversampling             =    2 << OVERSAMPLING_BAT_VOLTAGE;  // 16x for the battery voltage, see read_adc()
+uint8_t temperature_alpha        =   64;  // the weight of a temperature measurement in its average * 256
+uint8_t sampling_profile         = Sampling_Profile::adaptive;  // when to measure, see handleSampling.ino
+uint8_t state_of_charge          = SOC_UNKNOWN;  // the remaining capacity of the battery in percent, see handleBattery.ino
+uint8_t battery_health           = HEALTH_UNKNOWN;  // the health of the battery in percent, see update_health()
+volatile uint8_t eeprom_pending  =    0;  // number of registers not yet written to the EEPROM
 
 /*
    These are the 16 bit registers (the register numbers are defined in ATTinyDaemon.h).
@@ -70,12 +78,39 @@ int16_t  ext_voltage_constant    =    0;   // the constant added to the measurem
 uint16_t restart_voltage         = 3900;   // the battery voltage at which the RPi will be started again
 uint16_t warn_voltage            = 3400;   // the battery voltage at which the RPi should should down
 uint16_t shutdown_voltage        = 3200;   // the battery voltage at which a hard shutdown is executed
+uint16_t time_to_warn            = RUNTIME_UNKNOWN;  // the predicted seconds until warn_voltage is reached
+uint16_t time_to_shutdown        = RUNTIME_UNKNOWN;  // the predicted seconds until shutdown_voltage is reached
 uint16_t seconds                 =    0;   // seconds since last i2c access
-uint16_t temperature             =    0;   // the on-chip temperature
+int16_t  temperature             =    0;   // the on-chip temperature, negative below 0 degrees
 uint16_t temperature_coefficient = 1000;   // the multiplier for the measured temperature * 1000, the coefficient
 int16_t  temperature_constant    = -270;   // the constant added to the measurement as offset
 uint16_t reset_pulse_length      =  200;   // the reset pulse length (normally 200 for a reset, 4000 for switching)
 uint16_t switch_recovery_delay   = 1000;   // the pause needed between two reset pulse for the circuit recovery
+uint16_t i2c_address             = GUARDED_I2C_ADDRESS;  // the I2C address (low byte) and its complement
+uint16_t bat_process_noise       =  256;   // the variance of the battery voltage between two measurements (raw counts squared)
+uint16_t bat_measurement_noise   = 16384;  // the variance of a battery voltage measurement (raw counts squared)
+uint16_t sag_reference           =    0;   // the voltage sag of the new battery in mV, 0 takes the next one
+uint16_t sag_average             =    0;   // the average voltage sag at the load steps in mV, 0 if none has been seen
+
+/*
+   The measurements in the raw domain of the ADC (see read_adc()) and the
+   thresholds converted to it. The state changes only compare these, the voltage
+   and temperature registers above are converted from them once per
+   measurement (see update_millivolts()).
+   The battery voltage is measured inversely, the band gap reading rises when
+   the voltage drops.
+*/
+uint16_t bat_raw                 =      0;  // the filtered band gap reading, 0 until the first measurement
+uint16_t vcc_raw                 =      0;  // the band gap reading of the last measurement, the reference of ext_raw
+uint16_t ext_raw                 =      0;  // the reading of the external voltage relative to Vcc
+uint16_t temperature_raw         =      0;  // the reading of the temperature sensor
+uint16_t restart_raw             = 0xFFFF;  // restart_voltage in the raw domain
+uint16_t warn_raw                = 0xFFFF;  // warn_voltage in the raw domain
+uint16_t shutdown_raw            = 0xFFFF;  // shutdown_voltage in the raw domain
+volatile bool thresholds_stale   =   true;  // a threshold or the battery calibration has been written
+volatile bool calibration_stale  =   true;  // a coefficient or constant has been written
+bool millivolts_stale            =  false;  // there is a measurement that has not been converted
+volatile bool health_stale       =   true;  // sag_reference has been written or a load step has been seen
 
 void setup() {
   reset_watchdog ();  // do this first in case WDT fires
@@ -90,11 +125,17 @@ void setup() {
      access the file systems in R/W mode even in boot-optimized environments.
   */
 
+  // build the lookup index of the register table, needed by the EEPROM functions
+  init_registers();
+
   // EEPROM, read stored data or init
   read_or_init_EEPROM();
 
   // Initialize I2C
   init_I2C();
+
+  // watch the external voltage for power loss
+  init_power_monitor();
 }
 
 /*
@@ -104,12 +145,18 @@ void setup() {
    If the Raspberry has been shutdown, primed is not set and the button
    is pressed we want to restart the Raspberry. We set primed temporarily
    to trigger a restart in the main loop.
+   A change of the external voltage triggers the same interrupt and is
+   handled by check_power().
 */
 ISR (PCINT0_vect) {
+  if (check_power()) {
+    return;
+  }
+
   if (seconds > timeout && primed == 0) {
     primed = 1;
     // could be set during the shutdown while the timeout has not yet been exceeded. We reset it.
-    should_shutdown = Shutdown_Cause::none;
+    clear_shutdown_causes();
   } else {
     // signal the Raspberry that the button has been pressed.
     if (should_shutdown != Shutdown_Cause::rpi_initiated) {
@@ -120,6 +167,13 @@ ISR (PCINT0_vect) {
 
 void loop() {
   handle_state();
+  sample_history();
+  poll_power();
+  handle_load_steps();
+  track_changes();
+  update_I2C_address();
+  notify_host();
+  commit_EEPROM();
   handle_sleep();
 }
 
@@ -132,6 +186,8 @@ void loop() {
    Taken in part from http://www.gammon.com.au/power
  */
 void handle_sleep() {
+  wait_for_EEPROM();
+
   set_sleep_mode(SLEEP_MODE_PWR_DOWN);
   noInterrupts();           // timed sequence follows
   reset_watchdog();
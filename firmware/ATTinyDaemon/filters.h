@@ -0,0 +1,155 @@
+/*
+   Filters for the raw measurements (see read_voltages()). Each channel gets
+   its own chain of filters, composed at compile time with Chain, so only the
+   filters a channel actually uses end up in the flash. Every filter has
+     uint16_t apply(uint16_t value)   filter the next measurement
+     void reset()                     forget all previous measurements
+   Parameters that can be tuned at runtime are passed as references to the
+   variables of their registers, this costs no RAM in the filter.
+*/
+#ifndef FILTERS_H
+#define FILTERS_H
+
+/*
+   The value passes unchanged
+*/
+class Pass {
+  public:
+    uint16_t apply(uint16_t value) {
+      return value;
+    }
+    void reset() {}
+};
+
+/*
+   The output of First is filtered by Second
+*/
+template<class First, class Second>
+class Chain {
+  public:
+    uint16_t apply(uint16_t value) {
+      return second.apply(first.apply(value));
+    }
+    void reset() {
+      first.reset();
+      second.reset();
+    }
+
+  private:
+    First first;
+    Second second;
+};
+
+/*
+   The median of the last N measurements, a single spike (e.g., a load burst
+   of the Raspberry) is thrown away completely. Until N measurements have been
+   seen, the median of the ones available is used.
+*/
+template<uint8_t N>
+class Median {
+  public:
+    uint16_t apply(uint16_t value) {
+      window[next] = value;
+      next = (next + 1) % N;
+      if (count < N) {
+        count++;
+      }
+
+      // insertion sort of a copy, N is small
+      uint16_t sorted[N];
+      for (uint8_t i = 0; i < count; i++) {
+        uint16_t current = window[i];
+        uint8_t j = i;
+        for (; j > 0 && sorted[j - 1] > current; j--) {
+          sorted[j] = sorted[j - 1];
+        }
+        sorted[j] = current;
+      }
+      return sorted[count / 2];
+    }
+    void reset() {
+      next = 0;
+      count = 0;
+    }
+
+  private:
+    uint16_t window[N];
+    uint8_t next = 0;
+    uint8_t count = 0;
+};
+
+/*
+   Exponential moving average, every measurement is weighted with alpha / 256.
+   The average is kept with 8 additional bits so small changes are not lost.
+*/
+template<const uint8_t &alpha>
+class Ema {
+  public:
+    uint16_t apply(uint16_t value) {
+      if (!started) {
+        average = (uint32_t)value << 8;
+        started = true;
+      } else {
+        average += ((int32_t)value - (uint16_t)(average >> 8)) * alpha;
+      }
+      return average >> 8;
+    }
+    void reset() {
+      started = false;
+    }
+
+  private:
+    uint32_t average;
+    bool started = false;
+};
+
+/*
+   Scalar Kalman filter for a slowly changing value. process_noise is the
+   variance the value changes by between two measurements, measurement_noise
+   the variance of a measurement (both in raw counts squared). The gain starts
+   high and settles at the balance of the two, i.e. the filter follows quickly
+   after a reset and smooths strongly afterwards. The gain is 8 bit fixed-point,
+   its division is only calculated while the error variance still changes.
+*/
+template<const uint16_t &process_noise, const uint16_t &measurement_noise>
+class Kalman {
+  public:
+    uint16_t apply(uint16_t value) {
+      uint16_t q;
+      uint16_t r;
+      ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        q = process_noise;
+        r = measurement_noise;
+      }
+
+      if (!started) {
+        estimate = (uint32_t)value << 8;
+        variance = r;
+        started = true;
+        return value;
+      }
+
+      uint32_t predicted = variance + q;
+      if (predicted != last_predicted || r != last_r) {
+        last_predicted = predicted;
+        last_r = r;
+        gain = predicted + r != 0 ? (predicted << 8) / (predicted + r) : 256;
+      }
+      estimate += ((int32_t)value - (uint16_t)(estimate >> 8)) * gain;
+      variance = predicted * (256 - gain) >> 8;
+      return estimate >> 8;
+    }
+    void reset() {
+      started = false;
+    }
+
+  private:
+    uint32_t estimate;                    // with 8 additional bits as in Ema
+    uint32_t variance;                    // the error variance of the estimate
+    uint32_t last_predicted = 0;          // the predicted variance the gain has been calculated for
+    uint16_t last_r = 0;
+    uint16_t gain = 0;                    // 0 - 256
+    bool started = false;
+};
+
+#endif
@@ -0,0 +1,272 @@
+/*
+   The state of charge of the battery. The voltage of a Li-ion cell falls
+   steeply right after a full charge, then almost linearly for most of its
+   capacity and steeply again when it is nearly empty (see
+   miscellaneous/liion_typical_discharge_graph.png). The curve is stored as a
+   few points in flash and interpolated linearly between them, so the Raspberry
+   gets a percentage instead of fitting the curve to the voltage on every poll.
+   The curve holds for a cell under moderate load, while charging the voltage
+   is higher and the percentage reads high.
+*/
+const Charge_Point discharge_curve[] PROGMEM = {
+  // millivolts, percent, ascending
+  { 3000,   0 },
+  { 3300,   5 },
+  { 3450,  10 },
+  { 3600,  20 },
+  { 3700,  35 },
+  { 3800,  50 },
+  { 3900,  62 },
+  { 4000,  75 },
+  { 4100,  88 },
+  { 4200, 100 },
+};
+
+const uint8_t NUM_CHARGE_POINTS = sizeof(discharge_curve) / sizeof(discharge_curve[0]);
+
+/*
+   Convert the battery voltage and the temperature to the state of charge.
+   Called from update_millivolts(), i.e. once per measurement.
+*/
+void update_state_of_charge(uint16_t millivolts, int16_t temperature) {
+  if (millivolts == 0) {
+    // no measurement yet
+    state_of_charge = SOC_UNKNOWN;
+    return;
+  }
+  if (temperature < SOC_REFERENCE_TEMPERATURE) {
+    millivolts += (SOC_REFERENCE_TEMPERATURE - max(temperature, -40)) * SOC_COLD_COMPENSATION;
+  }
+
+  Charge_Point lower;
+  Charge_Point upper;
+  memcpy_P(&upper, &discharge_curve[0], sizeof(upper));
+  if (millivolts <= upper.millivolts) {
+    state_of_charge = upper.percent;
+    return;
+  }
+  for (uint8_t i = 1; i < NUM_CHARGE_POINTS; i++) {
+    lower = upper;
+    memcpy_P(&upper, &discharge_curve[i], sizeof(upper));
+    if (millivolts < upper.millivolts) {
+      // at most 300mV * 15% between two points, this fits into 16 bits
+      uint16_t span = upper.millivolts - lower.millivolts;
+      uint16_t scaled = (millivolts - lower.millivolts) * (upper.percent - lower.percent) + span / 2;
+      state_of_charge = lower.percent + scaled / span;
+      return;
+    }
+  }
+  state_of_charge = upper.percent;
+}
+
+/*
+   The time until the warn and shutdown voltage are reached. A sample of the
+   filtered battery voltage is taken after a measurement once RUNTIME_INTERVAL
+   seconds have passed, the slope of the least squares line through the last
+   RUNTIME_SAMPLES samples (x = 0 .. N - 1 from the oldest) is
+     6 * (2 * sum(x * y) - (N - 1) * sum(y)) / (N * (N^2 - 1))
+   Both sums are kept up to date when a sample enters or leaves the window,
+   so a sample only costs a few additions. Between the samples the predictions
+   count down with the seconds slept. They are RUNTIME_UNKNOWN until the window
+   is full and while the voltage does not fall.
+*/
+uint16_t runtime_samples[RUNTIME_SAMPLES];
+uint8_t runtime_next = 0;                 // the position of the next sample
+uint8_t runtime_count = 0;                // the number of valid samples
+uint8_t runtime_elapsed = RUNTIME_INTERVAL;  // seconds since the last sample, the first is taken immediately
+uint32_t runtime_sum = 0;                 // sum(y)
+uint32_t runtime_moment = 0;              // sum(x * y)
+
+/*
+   Called with the seconds slept (see reset_watchdog())
+*/
+void advance_runtime(uint8_t elapsed) {
+  if (runtime_elapsed < RUNTIME_INTERVAL) {
+    runtime_elapsed += elapsed;
+  }
+  count_down(time_to_warn, elapsed);
+  count_down(time_to_shutdown, elapsed);
+}
+
+void count_down(uint16_t &time, uint8_t elapsed) {
+  if (time != RUNTIME_UNKNOWN) {
+    time = time > elapsed ? time - elapsed : 0;
+  }
+}
+
+/*
+   Forget all samples, called when the battery voltage filter restarts
+*/
+void reset_runtime() {
+  runtime_next = 0;
+  runtime_count = 0;
+  runtime_sum = 0;
+  runtime_moment = 0;
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    time_to_warn = RUNTIME_UNKNOWN;
+    time_to_shutdown = RUNTIME_UNKNOWN;
+  }
+}
+
+/*
+   Called after each measurement of the state machine, takes a sample if it is
+   due and updates the predictions
+*/
+void sample_runtime() {
+  if (runtime_elapsed < RUNTIME_INTERVAL) {
+    return;
+  }
+  runtime_elapsed = 0;
+  uint16_t millivolts = calibrated_bat_millivolts(bat_raw);
+
+  if (runtime_count == RUNTIME_SAMPLES) {
+    // the oldest sample leaves, every other one moves one position towards it
+    runtime_sum -= runtime_samples[runtime_next];
+    runtime_moment -= runtime_sum;
+    runtime_count--;
+  }
+  runtime_moment += (uint32_t)runtime_count * millivolts;
+  runtime_sum += millivolts;
+  runtime_samples[runtime_next] = millivolts;
+  runtime_next = (runtime_next + 1) % RUNTIME_SAMPLES;
+  runtime_count++;
+
+  uint16_t warn_time = RUNTIME_UNKNOWN;
+  uint16_t shutdown_time = RUNTIME_UNKNOWN;
+  if (runtime_count == RUNTIME_SAMPLES) {
+    // the slope * RUNTIME_SLOPE_DIVISOR in mV per sample
+    int32_t slope = 2 * runtime_moment - (uint32_t)(RUNTIME_SAMPLES - 1) * runtime_sum;
+    if (slope < 0) {
+      uint16_t current_warn_voltage;
+      uint16_t current_shutdown_voltage;
+      ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        current_warn_voltage = warn_voltage;
+        current_shutdown_voltage = shutdown_voltage;
+      }
+      warn_time = time_to_reach(millivolts, current_warn_voltage, -slope);
+      shutdown_time = time_to_reach(millivolts, current_shutdown_voltage, -slope);
+    }
+  }
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    time_to_warn = warn_time;
+    time_to_shutdown = shutdown_time;
+  }
+}
+
+/*
+   The seconds until millivolts falls to threshold with the given slope (see
+   sample_runtime()). At most 65535mV * 680 * 30 fits into 32 bits. Very
+   slow discharges are capped just below RUNTIME_UNKNOWN.
+*/
+uint16_t time_to_reach(uint16_t millivolts, uint16_t threshold, uint32_t falling) {
+  if (millivolts <= threshold) {
+    return 0;
+  }
+  uint32_t time = (uint32_t)(millivolts - threshold) * (RUNTIME_SLOPE_DIVISOR * RUNTIME_INTERVAL) / falling;
+  return min(time, (uint32_t)RUNTIME_UNKNOWN - 1);
+}
+
+/*
+   The health of the battery. A worn cell has a higher internal resistance, its
+   voltage sags more when the Raspberry starts. We measure the battery voltage
+   right before and LOAD_STEP_DELAY after each switch of the Raspberry (see
+   ups_on() and ups_off()), the difference is the sag caused by its current.
+   sag_average follows the sags of these steps and is persisted, the first
+   one becomes sag_reference (the Raspberry writes 0 to it after replacing the
+   battery, this restarts the average as well). The health falls linearly
+   from 100 at sag_reference to 0 when the sag has doubled, the usual end of
+   life of a Li-ion cell.
+   A loss of the external voltage is a load step as well, it is reported in
+   load_step but not averaged: the voltage before it is held up by the
+   charger and the difference is not a property of the battery.
+*/
+Load_Step load_step = { Load_Step_Kind::none, 0, 0 };
+uint16_t power_loss_raw = 0;              // bat_raw before the last loss of the external voltage, set by check_power()
+
+/*
+   Measure the voltage after a load step and average its sag
+*/
+void record_load_step(uint8_t kind, uint16_t before) {
+  delay(LOAD_STEP_DELAY);
+  uint16_t after = measure_bat_millivolts();
+
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    load_step.kind = kind;
+    load_step.before = before;
+    load_step.after = after;
+  }
+
+  int16_t sag = kind == Load_Step_Kind::ups_off ? after - before : before - after;
+  if (kind == Load_Step_Kind::power_loss || sag < LOAD_STEP_MIN) {
+    // not averaged, or the load did not change (e.g., the Raspberry was already on)
+    return;
+  }
+
+  bool first = false;
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    if (sag_average == 0) {
+      sag_average = sag;
+    } else {
+      sag_average += (sag - (int16_t)sag_average) >> SAG_AVERAGE_SHIFT;
+    }
+    if (sag_reference == 0) {
+      sag_reference = sag_average;
+      first = true;
+    }
+  }
+  if (first) {
+    persist_register(Register::sag_reference);
+  }
+  persist_register(Register::sag_average);
+  health_stale = true;
+}
+
+/*
+   Called by the main loop, measures the voltage after a loss of the external
+   voltage and calculates the health after a change
+*/
+void handle_load_steps() {
+  uint16_t before_raw;
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    before_raw = power_loss_raw;
+    power_loss_raw = 0;
+  }
+  if (before_raw != 0) {
+    record_load_step(Load_Step_Kind::power_loss, calibrated_bat_millivolts(before_raw));
+  }
+  update_health();
+}
+
+void update_health() {
+  if (!health_stale) {
+    return;
+  }
+  health_stale = false;
+
+  uint16_t reference;
+  uint16_t average;
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    reference = sag_reference;
+    average = sag_average;
+  }
+  if (reference == 0 && average != 0) {
+    // the Raspberry has cleared sag_reference, i.e. the battery has been replaced
+    average = 0;
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+      sag_average = 0;
+    }
+    persist_register(Register::sag_average);
+  }
+
+  uint8_t health = HEALTH_UNKNOWN;
+  if (reference != 0 && average != 0) {
+    reference = max(reference, SAG_REFERENCE_MIN);
+    // 100 * (2 * reference - average) / reference
+    int32_t margin = 2 * (int32_t)reference - average;
+    health = constrain(100 * margin / reference, 0, 100);
+  }
+  if (health != battery_health) {
+    battery_health = health;
+    mark_register_changed(Register::battery_health);
+  }
+}
@@ -11,7 +11,9 @@ const uint8_t CRC8POLY = 0x31;                         // The CRC8 polynome used
 
 /*
    This function adds the current byte of data to the existing CRC calculation in the
-   variable reg.
+   variable reg. This is the original bit-serial implementation, it is kept as the
+   reference for the table-driven one below and is used if CRC8_REFERENCE is defined.
+   Its results have to be finished with crc8_finish().
 */
 unsigned char crc8_bytecalc(uint8_t data, uint8_t reg)
 {
@@ -32,32 +34,99 @@ unsigned char crc8_bytecalc(uint8_t data, uint8_t reg)
 }
 
 /*
-   This function calculates the CRC8 of a msg using the function crc8_bytecalc()
+   The table-driven implementation processes a nibble per step instead of a bit. The
+   table holds the CRC of each nibble value shifted through the polynome, it is small
+   enough to be kept in flash without hurting the 8K budget (a full byte table would
+   need 256 bytes). On the AVR this needs about a third of the cycles per byte of the
+   bit-serial loop. Since it works on the remainder directly (the Raspberry does the
+   same), there is no need to continue the calculation with a 0 byte at the end.
+*/
+const uint8_t crc8_table[16] PROGMEM = {
+  0x00, 0x31, 0x62, 0x53, 0xC4, 0xF5, 0xA6, 0x97, 0xB9, 0x88, 0xDB, 0xEA, 0x7D, 0x4C, 0x1F, 0x2E
+};
+
+/*
+   Add a byte of data to the CRC calculation
+*/
+uint8_t crc8_update(uint8_t data, uint8_t crc) {
+#ifdef CRC8_REFERENCE
+  return crc8_bytecalc(data, crc);
+#else
+  crc ^= data;
+  crc = (crc << 4) ^ pgm_read_byte(&crc8_table[crc >> 4]);
+  crc = (crc << 4) ^ pgm_read_byte(&crc8_table[crc >> 4]);
+  return crc;
+#endif
+}
+
+/*
+   Finish the CRC calculation, only needed for the bit-serial implementation
+   which has to be continued for the bit length of the polynome with 0 values
+*/
+uint8_t crc8_finish(uint8_t crc) {
+#ifdef CRC8_REFERENCE
+  return crc8_bytecalc(0, crc);
+#else
+  return crc;
+#endif
+}
+
+/*
+   This function calculates the CRC8 of a msg using the function crc8_update()
 */
 unsigned char crc8_message_calc(uint8_t *msg, uint8_t len)
 {
   uint8_t reg = CRC8INIT;
   uint8_t i;
   for (i = 0; i < len; i++) {
-    reg = crc8_bytecalc(msg[i], reg);      // calculate the CRC for the next byte of data and add it to reg
+    reg = crc8_update(msg[i], reg);      // calculate the CRC for the next byte of data and add it to reg
   }
-  return crc8_bytecalc(0, reg);      // The calculation has to be continued for the bit length of the polynome with 0 values
+  return crc8_finish(reg);
 }
 
 /*
-   This function calculates the CRC8 of a msg using the function crc8_bytecalc()
-   and writes the message followed by the crc to I2C.
+   This function calculates the CRC8 of a response, i.e. of the register number
+   followed by the msg, using the function crc8_update().
 */
-
-void write_data_crc(uint8_t *msg, uint8_t len) {
-  uint8_t reg = CRC8INIT;
+uint8_t data_crc(Register reg, const uint8_t *msg, uint8_t len) {
+  uint8_t crc = CRC8INIT;
   uint8_t i;
-  reg = crc8_bytecalc((uint8_t) register_number, reg);
+  crc = crc8_update((uint8_t) reg, crc);
   for (i = 0; i < len; i++) {
-    reg = crc8_bytecalc(msg[i], reg);
+    crc = crc8_update(msg[i], crc);
   }
-  uint8_t crc = crc8_bytecalc(0, reg);
+  return crc8_finish(crc);
+}
+
+/*
+   This function calculates the CRC8 of a msg using the function data_crc()
+   and writes the message followed by the crc to I2C.
+*/
+
+void write_data_crc(uint8_t *msg, uint8_t len) {
+  uint8_t crc = data_crc(register_number, msg, len);
 
   Wire.write(msg, len);
   Wire.write(&crc, 1);
 }
+
+/*
+   Chunks of a stream are longer than the usual responses, they are protected
+   by a CRC-16 (XMODEM, polynome 0x1021, init 0) of the register number
+   followed by the chunk. _crc_xmodem_update() of avr-libc is hand-optimized
+   assembler and needs no table.
+*/
+uint16_t data_crc16(Register reg, const uint8_t *msg, uint8_t len) {
+  uint16_t crc = _crc_xmodem_update(0, (uint8_t) reg);
+  for (uint8_t i = 0; i < len; i++) {
+    crc = _crc_xmodem_update(crc, msg[i]);
+  }
+  return crc;
+}
+
+void write_data_crc16(uint8_t *msg, uint8_t len) {
+  uint16_t crc = data_crc16(register_number, msg, len);
+
+  Wire.write(msg, len);
+  Wire.write((uint8_t *)&crc, sizeof(crc));
+}
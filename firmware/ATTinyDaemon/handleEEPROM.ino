@@ -14,28 +14,25 @@ void  read_or_init_EEPROM() {
 }
 
 /*
-   Read the values stored in the EEPROM. The addresses are defined in
-   the header file. We use the modern get()-method that determines the
-   object size itself, because the accompanying put()-method uses the
-   update()-function that checks whether the data has been modified
-   before it writes.
+   Read the values stored in the EEPROM. The addresses and sizes are taken
+   from the register table, every register with an EEPROM slot is read.
+   Invalid values (see valid_value()) are ignored, the register keeps its
+   default.
 */
 void read_EEPROM_values() {
-  EEPROM.get(EEPROM_Address::timeout, timeout);
-  EEPROM.get(EEPROM_Address::primed, primed);
-  EEPROM.get(EEPROM_Address::restart_voltage, restart_voltage);
-  EEPROM.get(EEPROM_Address::warn_voltage, warn_voltage);
-  EEPROM.get(EEPROM_Address::shutdown_voltage, shutdown_voltage);
-  EEPROM.get(EEPROM_Address::bat_voltage_coefficient, bat_voltage_coefficient);
-  EEPROM.get(EEPROM_Address::bat_voltage_constant, bat_voltage_constant);
-  EEPROM.get(EEPROM_Address::ext_voltage_coefficient, ext_voltage_coefficient);
-  EEPROM.get(EEPROM_Address::ext_voltage_constant, ext_voltage_constant);
-  EEPROM.get(EEPROM_Address::temperature_coefficient, temperature_coefficient);
-  EEPROM.get(EEPROM_Address::temperature_constant, temperature_constant);
-  EEPROM.get(EEPROM_Address::reset_configuration, reset_configuration);
-  EEPROM.get(EEPROM_Address::reset_pulse_length, reset_pulse_length);
-  EEPROM.get(EEPROM_Address::switch_recovery_delay, switch_recovery_delay);
-  EEPROM.get(EEPROM_Address::led_off_mode, led_off_mode);
+  Register_Descriptor descriptor;
+  uint8_t value[sizeof(uint32_t)];
+  for (uint8_t row = 0; read_descriptor(row, descriptor); row++) {
+    if (descriptor.eeprom != EEPROM_Address::none) {
+      uint8_t size = descriptor.flags & Register_Flag::size_mask;
+      for (uint8_t i = 0; i < size; i++) {
+        value[i] = EEPROM.read(descriptor.eeprom + i);
+      }
+      if (valid_value(descriptor, value)) {
+        memcpy(descriptor.data, value, size);
+      }
+    }
+  }
 }
 
 /*
@@ -43,27 +40,147 @@ void read_EEPROM_values() {
    held values in our variables. This function is called when,
    in the setup() function, we determine that no valid EEPROM
    data can be read (by checking the EEPROM_INIT_VALUE).
-   This method can also be used later from the Raspberry to
-   reinit the EEPROM, but individual values are written at once
-   whenever they are transmitted using I2C (see the function
-   receiveEvent()).
+   The values themselves are written by the EEPROM writer (see below)
+   once the main loop is running. It writes EEPROM_INIT_VALUE after the last
+   of them, a power loss before leaves the EEPROM uninitialized instead of
+   marking unwritten bytes as valid.
 */
+volatile bool eeprom_unmarked = false;    // EEPROM_INIT_VALUE is still to be written by the writer
+
 void init_EEPROM() {
-  // put uses update(), thus no unnecessary writes
-  EEPROM.put(EEPROM_Address::base, EEPROM_INIT_VALUE);
-  EEPROM.put(EEPROM_Address::timeout, timeout);
-  EEPROM.put(EEPROM_Address::primed, primed);
-  EEPROM.put(EEPROM_Address::restart_voltage, restart_voltage);
-  EEPROM.put(EEPROM_Address::warn_voltage, warn_voltage);
-  EEPROM.put(EEPROM_Address::shutdown_voltage, shutdown_voltage);
-  EEPROM.put(EEPROM_Address::bat_voltage_coefficient, bat_voltage_coefficient);
-  EEPROM.put(EEPROM_Address::bat_voltage_constant, bat_voltage_constant);
-  EEPROM.put(EEPROM_Address::ext_voltage_coefficient, ext_voltage_coefficient);
-  EEPROM.put(EEPROM_Address::ext_voltage_constant, ext_voltage_constant);
-  EEPROM.put(EEPROM_Address::temperature_coefficient, temperature_coefficient);
-  EEPROM.put(EEPROM_Address::temperature_constant, temperature_constant);
-  EEPROM.put(EEPROM_Address::reset_configuration, reset_configuration);
-  EEPROM.put(EEPROM_Address::reset_pulse_length, reset_pulse_length);
-  EEPROM.put(EEPROM_Address::switch_recovery_delay, switch_recovery_delay);
-  EEPROM.put(EEPROM_Address::led_off_mode, led_off_mode);
+  eeprom_unmarked = true;
+  schedule_EEPROM_rewrite();
+}
+
+/*
+   The EEPROM writer. Writing a byte to the EEPROM takes about 3.4ms, which
+   is far too long to be done in the I2C callbacks. Instead, a register
+   written over I2C is only marked in eeprom_dirty (one bit per row of the
+   register table) and the main loop starts the writer using commit_EEPROM().
+   The writer is driven by the EE_READY interrupt: each time the EEPROM is
+   ready it writes the next byte that differs from the stored one, until no
+   dirty register is left. Meanwhile the CPU sleeps in handle_sleep().
+   An interrupt compares at most one row. If the row is unchanged it returns
+   with EE_READY still enabled, which fires again at once while the EEPROM is
+   idle, so a rewrite of unchanged values never blocks the interrupts for long.
+   If a register is written again while it is being committed it is simply
+   marked again and written a second time.
+*/
+volatile uint8_t eeprom_dirty[MAX_REGISTERS / 8];
+volatile uint8_t eeprom_row = NO_ROW;     // the row currently written
+volatile uint8_t eeprom_byte;             // the next byte of this row
+
+/*
+   Mark a row of the register table to be written to the EEPROM
+*/
+void schedule_EEPROM_write(uint8_t row) {
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    if (!(eeprom_dirty[row >> 3] & bit(row & 0x7))) {
+      eeprom_dirty[row >> 3] |= bit(row & 0x7);
+      eeprom_pending++;
+    }
+  }
+}
+
+/*
+   Mark all persisted registers to be written to the EEPROM. This is used by
+   the Raspberry to reinit the EEPROM and by init_EEPROM().
+*/
+void schedule_EEPROM_rewrite() {
+  Register_Descriptor descriptor;
+  for (uint8_t row = 0; read_descriptor(row, descriptor); row++) {
+    if (descriptor.eeprom != EEPROM_Address::none) {
+      schedule_EEPROM_write(row);
+    }
+  }
+}
+
+/*
+   Start the EEPROM writer if there is anything to write. The writer stops
+   itself by disabling the interrupt when it is done.
+*/
+void commit_EEPROM() {
+  if (eeprom_pending != 0) {
+    EECR |= bit(EERIE);
+  }
+}
+
+/*
+   EE_READY does not wake the CPU from power down. Let a running commit finish
+   in idle mode, the CPU sleeps between the bytes and is woken by the writer.
+*/
+void wait_for_EEPROM() {
+  set_sleep_mode(SLEEP_MODE_IDLE);
+  noInterrupts();
+  while (EECR & bit(EERIE)) {
+    sleep_enable();
+    interrupts();             // guarantees next instruction executed
+    sleep_cpu();
+    sleep_disable();
+    noInterrupts();
+  }
+  interrupts();
+}
+
+/*
+   Find the next row marked in eeprom_dirty, clear its mark and return it.
+   Returns NO_ROW if nothing is left to write.
+*/
+uint8_t next_dirty_row() {
+  for (uint8_t row = 0; row < MAX_REGISTERS; row++) {
+    if (eeprom_dirty[row >> 3] & bit(row & 0x7)) {
+      eeprom_dirty[row >> 3] &= ~bit(row & 0x7);
+      return row;
+    }
+  }
+  return NO_ROW;
+}
+
+/*
+   Start writing a byte, the EE_READY interrupt follows when it is done
+*/
+void write_EEPROM_byte(uint8_t address, uint8_t value) {
+  // atomic erase and write, data sheet ch. 5.5.3, EEMPE has to be followed by EEPE within 4 cycles
+  EEAR = address;
+  EEDR = value;
+  EECR |= bit(EEMPE);
+  EECR |= bit(EEPE);
+}
+
+ISR (EE_RDY_vect) {
+  Register_Descriptor descriptor;
+
+  if (eeprom_row == NO_ROW) {
+    eeprom_row = next_dirty_row();
+    eeprom_byte = 0;
+    if (eeprom_row == NO_ROW) {
+      if (eeprom_unmarked) {
+        // all values are written, now they are valid
+        eeprom_unmarked = false;
+        if (EEPROM.read(EEPROM_Address::base) != EEPROM_INIT_VALUE) {
+          write_EEPROM_byte(EEPROM_Address::base, EEPROM_INIT_VALUE);
+          return;
+        }
+      }
+      // we are done
+      EECR &= ~bit(EERIE);
+      return;
+    }
+  }
+
+  read_descriptor(eeprom_row, descriptor);
+  uint8_t size = descriptor.flags & Register_Flag::size_mask;
+  while (eeprom_byte < size) {
+    uint8_t address = descriptor.eeprom + eeprom_byte;
+    uint8_t value = ((uint8_t *)descriptor.data)[eeprom_byte];
+    eeprom_byte++;
+
+    if (EEPROM.read(address) != value) {
+      write_EEPROM_byte(address, value);
+      return;
+    }
+  }
+  // this row is done, the interrupt fires again right away for the next one
+  eeprom_row = NO_ROW;
+  eeprom_pending--;
 }
@@ -1,12 +1,43 @@
 /*
-   Initialize the I2C connection
+   Initialize the I2C connection. The address is read from the EEPROM, if it
+   is not valid (e.g., an EEPROM written by an older version) we use the default.
  */
 void init_I2C() {
-  Wire.begin(I2C_ADDRESS);
+  if (!valid_I2C_address((uint8_t *)&i2c_address)) {
+    i2c_address = GUARDED_I2C_ADDRESS;
+  }
+  Wire.begin((uint8_t) i2c_address);
   Wire.onRequest(request_event);
   Wire.onReceive(receive_event);  
 }
 
+/*
+   The I2C address can be changed by writing the new address followed by its
+   complement to the i2c_address register. The complement guards against
+   accidental writes, a wrong address would make us unreachable. Addresses
+   reserved by the I2C specification are rejected as well.
+*/
+bool valid_I2C_address(const uint8_t *value) {
+  return value[1] == (uint8_t)~value[0] && value[0] >= 0x08 && value[0] <= 0x77;
+}
+
+/*
+   The new address is not used before the main loop runs, we are still in the
+   middle of the transfer that changed it.
+*/
+bool i2c_address_changed = false;
+
+void change_I2C_address() {
+  i2c_address_changed = true;
+}
+
+void update_I2C_address() {
+  if (i2c_address_changed) {
+    i2c_address_changed = false;
+    init_I2C();
+  }
+}
+
 /*
    This method is called when either a register number is transferred (1 byte)
    or data is written to a register.
@@ -16,13 +47,59 @@ void init_I2C() {
    When data is requested we simply send the data on the bus and hope for the best.
    Transmission errors are fixed on the receiving side (the Raspberry) by simply
    retrying the read.
+   The buffer has the size of the USI receive buffer, which limits the size of
+   a batch write.
+*/
+const uint8_t BUFFER_SIZE = 16;
+
+/*
+   The link counters tell the Raspberry how often frames are dropped, it can
+   use them to tune its timing and number of retries. register_received is set
+   when a register number has been received and cleared by the following read.
 */
-const uint8_t BUFFER_SIZE = 8;
+Link_Counters link_counters;
+bool register_received = false;
+
+/*
+   The result of the last write frame. The Raspberry confirms a write by
+   reading it instead of reading back the register.
+*/
+Write_Status write_status = { 0, Write_Result::applied, 0 };
+
+/*
+   Latch the result of a write frame and count rejected writes
+*/
+void set_write_status(uint8_t reg, uint8_t result) {
+  write_status.reg = reg;
+  write_status.result = result;
+  write_status.sequence++;
+  if (result == Write_Result::crc_mismatch) {
+    saturating_increment(link_counters.crc_errors);
+  } else if (result == Write_Result::oversize) {
+    saturating_increment(link_counters.oversize);
+  } else if (result != Write_Result::applied) {
+    saturating_increment(link_counters.unknown_register);
+  }
+}
+
+/*
+   Increment a counter, saturating at its maximum
+*/
+void saturating_increment(uint16_t &counter) {
+  if (counter != 0xFFFF) {
+    counter++;
+  }
+}
 
 uint8_t rbuf[BUFFER_SIZE];
 void receive_event(int bytes) {
 
   i2c_triggered_state_change();
+  saturating_increment(link_counters.transactions);
+
+  if (bytes < 1) {
+    return;
+  }
 
   uint8_t count = BUFFER_SIZE > bytes ? bytes : BUFFER_SIZE;
   for (int i = 0; i < count; i++) {
@@ -32,106 +109,32 @@ void receive_event(int bytes) {
     // something is seriously wrong. Clean up and try to recover
     for (int i = BUFFER_SIZE; i < bytes; i++)
       Wire.read();
+    // the data is incomplete, we neither check nor use it
+    set_write_status(rbuf[0], Write_Result::oversize);
+    reset_counter();
+    return;
   }
 
   // Read the first byte to determine which register is concerned
   register_number = static_cast<Register>(rbuf[0]);
+  register_received = true;
 
-  // check that the data has been received correctly
-  uint8_t crc = crc8_message_calc(rbuf, bytes - 1);
-  if (crc == rbuf[bytes - 1])
-  {
-    // If there is more than 1 byte, then the master is writing to the slave
-    if (bytes == 3) {
-      // write an 8 bit register
-      switch (register_number) {
-        case Register::timeout:
-          timeout = rbuf[1];
-          EEPROM.put(EEPROM_Address::timeout, timeout);
-          break;
-        case Register::primed:
-          primed = rbuf[1];
-          EEPROM.put(EEPROM_Address::primed, primed);
-          break;
-        case Register::should_shutdown:
-          should_shutdown = rbuf[1];
-          break;
-        case Register::force_shutdown:
-          force_shutdown = rbuf[1];
-          EEPROM.put(EEPROM_Address::force_shutdown, force_shutdown);
-          break;
-        case Register::led_off_mode:
-          led_off_mode = rbuf[1];
-          EEPROM.put(EEPROM_Address::led_off_mode, led_off_mode);
-          break;          
-        case Register::reset_configuration:
-          reset_configuration = rbuf[1];
-          EEPROM.put(EEPROM_Address::reset_configuration, reset_configuration);
-          break;
-        case Register::init_eeprom:
-          uint8_t init_eeprom = rbuf[1];
-
-          if (init_eeprom != 0) {
-            init_EEPROM();
-          }
-          break;
-      }
-
-
-    } else if (bytes == 4) {
-      // write a 16 bit register
-
-      switch (register_number) {
-        case Register::restart_voltage:
-          restart_voltage = rbuf[1] | (rbuf[2] << 8);
-          EEPROM.put(EEPROM_Address::restart_voltage, restart_voltage);
-          break;
-        case Register::warn_voltage:
-          warn_voltage = rbuf[1] | (rbuf[2] << 8);
-          EEPROM.put(EEPROM_Address::warn_voltage, warn_voltage);
-          break;
-        case Register::shutdown_voltage:
-          shutdown_voltage = rbuf[1] | (rbuf[2] << 8);
-          EEPROM.put(EEPROM_Address::shutdown_voltage, shutdown_voltage);
-          break;
-        case Register::bat_voltage_coefficient:
-          bat_voltage_coefficient = rbuf[1] | (rbuf[2] << 8);
-          EEPROM.put(EEPROM_Address::bat_voltage_coefficient, bat_voltage_coefficient);
-          bat_voltage = 0;  // reset bat_voltage average
-          break;
-        case Register::bat_voltage_constant:
-          bat_voltage_constant = rbuf[1] | (rbuf[2] << 8);
-          EEPROM.put(EEPROM_Address::bat_voltage_constant, bat_voltage_constant);
-          bat_voltage = 0;  // reset bat_voltage average
-          break;
-        case Register::ext_voltage_coefficient:
-          ext_voltage_coefficient = rbuf[1] | (rbuf[2] << 8);
-          EEPROM.put(EEPROM_Address::ext_voltage_coefficient, ext_voltage_coefficient);
-          break;
-        case Register::ext_voltage_constant:
-          ext_voltage_constant = rbuf[1] | (rbuf[2] << 8);
-          EEPROM.put(EEPROM_Address::ext_voltage_constant, ext_voltage_constant);
-          break;
-        case Register::temperature_coefficient:
-          temperature_coefficient = rbuf[1] | (rbuf[2] << 8);
-          EEPROM.put(EEPROM_Address::temperature_coefficient, temperature_coefficient);
-          break;
-        case Register::temperature_constant:
-          temperature_constant = rbuf[1] | (rbuf[2] << 8);
-          EEPROM.put(EEPROM_Address::temperature_constant, temperature_constant);
-          break;
-        case Register::reset_pulse_length:
-          reset_pulse_length = rbuf[1] | (rbuf[2] << 8);
-          EEPROM.put(EEPROM_Address::reset_pulse_length, reset_pulse_length);
-          break;
-        case Register::switch_recovery_delay:
-          switch_recovery_delay = rbuf[1] | (rbuf[2] << 8);
-          EEPROM.put(EEPROM_Address::switch_recovery_delay, switch_recovery_delay);
-          break;
-      }
+  if (bytes > 1) {
+    // check that the data has been received correctly
+    uint8_t crc = crc8_message_calc(rbuf, bytes - 1);
+    if (crc != rbuf[bytes - 1]) {
+      set_write_status(rbuf[0], Write_Result::crc_mismatch);
+    } else if (bytes == 2) {
+      // a register number with a CRC but without data
+      set_write_status(rbuf[0], Write_Result::wrong_size);
+    } else if (register_number == Register::batch_write) {
+      // the master is writing several registers at once
+      set_write_status(rbuf[0], write_batch(rbuf + 1, bytes - 2));
+    } else if (register_number == Register::stream_cursor) {
+      set_write_status(rbuf[0], open_stream(rbuf + 1, bytes - 2));
+    } else {
+      set_write_status(rbuf[0], write_register(register_number, rbuf + 1, bytes - 2));
     }
-  }
-  if (bytes != 1) {
     // we had a write operation and reset the counter
     reset_counter();
   }
@@ -142,92 +145,252 @@ void receive_event(int bytes) {
    read data. The register_number contains the register to read.
 */
 void request_event() {
+  saturating_increment(link_counters.transactions);
+  if (!register_received) {
+    // we answer with the register read last, but the master might expect another one
+    saturating_increment(link_counters.read_without_register);
+  }
+  register_received = false;
+
   /*
     Read from the register variable to know what to send back.
   */
-  switch (register_number) {
+  uint8_t size;
+  uint8_t *data = register_data(register_number, size);
+
+  if (write_prepared_frame(register_number, data)) {
+    // nothing more to do
+  } else if (data != nullptr) {
+    write_data_crc(data, size);
+  } else if (register_number == Register::snapshot) {
+    write_snapshot();
+  } else if (register_number == Register::changed) {
+    uint8_t changed[MAX_REGISTERS / 8];
+    take_changed(changed);
+    write_data_crc(changed, sizeof(changed));
+  } else if (register_number == Register::link_counters) {
+    write_data_crc((uint8_t *)&link_counters, sizeof(link_counters));
+  } else if (register_number == Register::features) {
+    write_features();
+  } else if (register_number == Register::write_status) {
+    write_data_crc((uint8_t *)&write_status, sizeof(write_status));
+  } else if (register_number == Register::power_event) {
+    write_power_event();
+  } else if (register_number == Register::load_step) {
+    write_data_crc((uint8_t *)&load_step, sizeof(load_step));
+  } else if (register_number == Register::stream_cursor) {
+    write_stream_cursor();
+  } else if (register_number == Register::stream_chunk) {
+    write_stream_chunk();
+  } else if (register_number == Register::stream_retry) {
+    write_stream_retry();
+  } else if ((static_cast<uint8_t>(register_number) & 0xF0) == BLOCK_REGISTER_BASE) {
+    write_block(static_cast<uint8_t>(register_number) & 0x0F);
+  } else if ((static_cast<uint8_t>(register_number) & 0xF0) == DESCRIPTOR_REGISTER_BASE) {
+    write_descriptor_page(static_cast<uint8_t>(register_number) & 0x0F);
+  } else {
+    saturating_increment(link_counters.unknown_register);
+  }
+
+  // we had a read operation and reset the counter
+  reset_counter();
+}
+
+/*
+   SMBus Host Notify. If enabled, we briefly become bus master and tell the
+   Raspberry that should_shutdown has changed, so the daemon does not have to
+   wait for its next poll. The message is sent to the SMBus host address and
+   consists of our own address (shifted as in an address byte) followed by a
+   16 bit data word, we use it for the new value of should_shutdown.
+   The button interrupt and read_voltages() only change should_shutdown, the
+   message is sent from the main loop since we cannot act as master inside
+   an interrupt or while a transfer is running. The USI has no arbitration, if
+   the Raspberry starts a transfer at the same moment the message is lost and
+   we retry with the next loop.
+   Only notify == 1 enables the messages, an EEPROM written by an older version
+   holds 0xFF for this register.
+*/
+const uint8_t HOST_NOTIFY_ADDRESS = 0x08;  // the SMBus host address
+const uint8_t NOTIFY_RETRIES      = 3;     // attempts for each value, nobody might be listening
+
+uint8_t notified_should_shutdown = Shutdown_Cause::none;
+uint8_t notify_attempts = 0;
+
+void notify_host() {
+  uint8_t current = should_shutdown;
+
+  if (current != notified_should_shutdown) {
+    notified_should_shutdown = current;
+    notify_attempts = 0;
+  }
+  // only values the Raspberry has to act on are announced, not its own writes
+  if (notify != 1 || current <= Shutdown_Cause::rpi_initiated || notify_attempts >= NOTIFY_RETRIES) {
+    return;
+  }
+  notify_attempts++;
+
+  Wire.begin();
+  Wire.beginTransmission(HOST_NOTIFY_ADDRESS);
+  Wire.write((uint8_t) i2c_address << 1);
+  Wire.write(current);
+  Wire.write(0);
+  if (Wire.endTransmission() == 0) {
+    notify_attempts = NOTIFY_RETRIES;
+  }
+  // back to slave mode
+  init_I2C();
+}
+
+/*
+   Send all live telemetry in one frame protected by a single CRC. This allows
+   the Raspberry to refresh its status with one transaction instead of reading
+   every register on its own. We are called from request_event(), so the values
+   cannot change while we copy them.
+*/
+void write_snapshot() {
+  Snapshot snapshot;
+
+  snapshot.bat_voltage = bat_voltage;
+  snapshot.ext_voltage = ext_voltage;
+  snapshot.temperature = temperature;
+  snapshot.seconds = seconds;
+  snapshot.state = static_cast<uint8_t>(state);
+  snapshot.should_shutdown = should_shutdown;
+  snapshot.state_of_charge = state_of_charge;
+
+  write_data_crc((uint8_t *)&snapshot, sizeof(snapshot));
+}
+
+/*
+   Burst read of a whole register block. The registers are grouped by their high
+   nibble (0x11-0x16, 0x21-0x25, ...), reading register 0xB0 | n streams every
+   register of block n in ascending order, followed by a single CRC. Since the
+   blocks are small we assemble them in a local buffer that fits into the USI
+   transmit buffer (one byte of the 16 byte transmit buffer is left for the CRC).
+*/
+const uint8_t BLOCK_BUFFER_SIZE = 15;
 
-    case Register::last_access:
-      write_data_crc((uint8_t *)&seconds, sizeof(seconds));
+void write_block(uint8_t block) {
+  uint8_t buffer[BLOCK_BUFFER_SIZE];
+  uint8_t len = 0;
+
+  for (uint8_t i = 0; i < 0x10; i++) {
+    uint8_t size;
+    uint8_t *data = register_data(static_cast<Register>((block << 4) | i), size);
+
+    if (data == nullptr) {
+      continue;
+    }
+    if (len + size > BLOCK_BUFFER_SIZE) {
       break;
+    }
+    memcpy(buffer + len, data, size);
+    len += size;
+  }
+  write_data_crc(buffer, len);
+}
+
+/*
+   The register map describes itself: the features register holds the number
+   of rows of the register table and the supported features, the descriptor
+   pages stream the table itself. Each row is sent as the register number
+   followed by its flags (size, signedness, writable, persisted and readable). The
+   Raspberry builds its accessors and block reads from this instead of
+   relying on its own copy of the register list.
+*/
+void write_features() {
+  Features features;
+  Register_Descriptor descriptor;
+
+  features.registers = 0;
+  while (read_descriptor(features.registers, descriptor)) {
+    features.registers++;
+  }
+  features.features = FEATURES;
+  write_data_crc((uint8_t *)&features, sizeof(features));
+}
+
+void write_descriptor_page(uint8_t page) {
+  uint8_t buffer[2 * DESCRIPTORS_PER_PAGE];
+  uint8_t len = 0;
+  Register_Descriptor descriptor;
+
+  for (uint8_t row = page * DESCRIPTORS_PER_PAGE;
+       row < (page + 1) * DESCRIPTORS_PER_PAGE && read_descriptor(row, descriptor); row++) {
+    buffer[len++] = static_cast<uint8_t>(descriptor.reg);
+    buffer[len++] = descriptor.flags
+                    | (descriptor.eeprom != EEPROM_Address::none ? Register_Flag::persisted : 0)
+                    | (descriptor.data != nullptr ? Register_Flag::readable : 0);
+  }
+  write_data_crc(buffer, len);
+}
+
+/*
+   Prepared response frames for the registers the Raspberry polls most. The
+   CRC of these frames is calculated in the main loop right after the values
+   have been converted (see update_millivolts()), so request_event() only has to
+   copy bytes instead of running the bit-serial CRC while the Raspberry waits.
+   The frames are double-buffered: prepare_frames() fills the buffer not in
+   use and then flips frame_buffer, which is a single byte and thus changed
+   atomically. request_event() therefore always sees a complete frame.
+   A frame is only used if its value still matches the variable, otherwise
+   (e.g., the value has just been updated and its frame is not ready yet) the response
+   is calculated as before.
+*/
+const uint8_t NUM_FRAMES = 3;
+const uint8_t FRAME_SIZE = 3;             // 16 bit value followed by the CRC
+
+uint8_t frames[2][NUM_FRAMES][FRAME_SIZE];
+volatile uint8_t frame_buffer = 0;        // the buffer used by request_event()
+volatile bool frames_prepared = false;
+
+/*
+   Map a register to its prepared frame, returns NUM_FRAMES if there is none
+*/
+uint8_t frame_slot(Register reg) {
+  switch (reg) {
     case Register::bat_voltage:
-      write_data_crc((uint8_t *)&bat_voltage, sizeof(bat_voltage));
-      break;
+      return 0;
     case Register::ext_voltage:
-      write_data_crc((uint8_t *)&ext_voltage, sizeof(ext_voltage));
-      break;
-    case Register::bat_voltage_coefficient:
-      write_data_crc((uint8_t *)&bat_voltage_coefficient, sizeof(bat_voltage_coefficient));
-      break;
-    case Register::bat_voltage_constant:
-      write_data_crc((uint8_t *)&bat_voltage_constant, sizeof(bat_voltage_constant));
-      break;
-    case Register::ext_voltage_coefficient:
-      write_data_crc((uint8_t *)&ext_voltage_coefficient, sizeof(ext_voltage_coefficient));
-      break;
-    case Register::ext_voltage_constant:
-      write_data_crc((uint8_t *)&ext_voltage_constant, sizeof(ext_voltage_constant));
-      break;
-    case Register::timeout:
-      write_data_crc((uint8_t *)&timeout, sizeof(timeout));
-      break;
-    case Register::primed:
-      write_data_crc((uint8_t *)&primed, sizeof(primed));
-      break;
-    case Register::should_shutdown:
-      write_data_crc((uint8_t *)&should_shutdown, sizeof(should_shutdown));
-      break;
-    case Register::force_shutdown:
-      write_data_crc((uint8_t *)&force_shutdown, sizeof(force_shutdown));
-      break;
-    case Register::led_off_mode:
-      write_data_crc((uint8_t *)&led_off_mode, sizeof(led_off_mode));
-      break;      
-    case Register::restart_voltage:
-      write_data_crc((uint8_t *)&restart_voltage, sizeof(restart_voltage));
-      break;
-    case Register::warn_voltage:
-      write_data_crc((uint8_t *)&warn_voltage, sizeof(warn_voltage));
-      break;
-    case Register::shutdown_voltage:
-      write_data_crc((uint8_t *)&shutdown_voltage, sizeof(shutdown_voltage));
-      break;
+      return 1;
     case Register::temperature:
-      write_data_crc((uint8_t *)&temperature, sizeof(temperature));
-      break;
-    case Register::temperature_coefficient:
-      write_data_crc((uint8_t *)&temperature_coefficient, sizeof(temperature_coefficient));
-      break;
-    case Register::temperature_constant:
-      write_data_crc((uint8_t *)&temperature_constant, sizeof(temperature_constant));
-      break;
-    case Register::reset_configuration:
-      write_data_crc((uint8_t *)&reset_configuration, sizeof(reset_configuration));
-      break;
-    case Register::reset_pulse_length:
-      write_data_crc((uint8_t *)&reset_pulse_length, sizeof(reset_pulse_length));
-      break;      
-    case Register::switch_recovery_delay:
-      write_data_crc((uint8_t *)&switch_recovery_delay, sizeof(switch_recovery_delay));
-      break;
-    case Register::version:
-      write_data_crc((uint8_t *)&prog_version, sizeof(prog_version));
-      break;
-    case Register::fuse_low:
-      write_data_crc((uint8_t *)&fuse_low, sizeof(fuse_low));
-      break;
-    case Register::fuse_high:
-      write_data_crc((uint8_t *)&fuse_high, sizeof(fuse_high));
-      break;
-    case Register::fuse_extended:
-      write_data_crc((uint8_t *)&fuse_extended, sizeof(fuse_extended));
-      break;
-    case Register::internal_state:
-      write_data_crc((uint8_t *)&state, sizeof(state));
-      break;
+      return 2;
+    default:
+      return NUM_FRAMES;
   }
+}
 
+void prepare_frame(uint8_t *frame, Register reg, uint16_t value) {
+  memcpy(frame, &value, sizeof(value));
+  frame[sizeof(value)] = data_crc(reg, frame, sizeof(value));
+}
 
-  // we had a read operation and reset the counter
-  reset_counter();
+void prepare_frames() {
+  uint8_t next = frame_buffer ^ 1;
+
+  prepare_frame(frames[next][frame_slot(Register::bat_voltage)], Register::bat_voltage, bat_voltage);
+  prepare_frame(frames[next][frame_slot(Register::ext_voltage)], Register::ext_voltage, ext_voltage);
+  prepare_frame(frames[next][frame_slot(Register::temperature)], Register::temperature, temperature);
+
+  frame_buffer = next;
+  frames_prepared = true;
+}
+
+/*
+   Send the prepared frame of a register if there is an up to date one.
+   Returns false if the response has to be calculated.
+*/
+bool write_prepared_frame(Register reg, const uint8_t *data) {
+  uint8_t slot = frame_slot(reg);
+
+  if (slot == NUM_FRAMES || !frames_prepared) {
+    return false;
+  }
+
+  uint8_t *frame = frames[frame_buffer][slot];
+  if (frame[0] != data[0] || frame[1] != data[1]) {
+    return false;
+  }
+  Wire.write(frame, FRAME_SIZE);
+  return true;
 }
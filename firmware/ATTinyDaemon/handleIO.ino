@@ -36,6 +36,8 @@ uint8_t PB_READ(uint8_t pin) {
    The third method ledOff_buttonOff() turns off both LED and button sensing
    by channging LED_BUTTON to high impedance input and turning off the interrupt.
    It is used when we go into deep sleep to save as much power as possible.
+   The pin change interrupt is shared with PIN_EXT_VOLTAGE (see below), so
+   only the bit of LED_BUTTON is masked and the interrupt stays enabled.
 */
 void ledOff_buttonOn() {
   // switch back to monitoring button
@@ -51,21 +53,103 @@ void ledOn_buttonOff() {
   if(led_off_mode) {
     return;
   }
-  GIMSK &= ~(bit(PCIE));            // disable pin change interrupts
-  GIFR &= ~(bit(PCIF));             // clear interrupts
-  PCMSK &= ~(bit(LED_BUTTON));      // set interrupt pin
+  PCMSK &= ~(bit(LED_BUTTON));      // clear interrupt pin
 
   pb_output(LED_BUTTON);
   pb_low(LED_BUTTON);
 }
 
 void ledOff_buttonOff() {
-  // Go to high impedance and turn off the pin change interrupts
-  GIMSK &= ~(bit(PCIE));            // disable pin change interrupts
+  // Go to high impedance and turn off the pin change interrupt of the button
+  PCMSK &= ~(bit(LED_BUTTON));      // clear interrupt pin
   pb_input(LED_BUTTON);
   pb_low(LED_BUTTON);
 }
 
+/*
+   Power loss detection. Sampling the external voltage with the ADC notices a
+   loss only with the next wake, i.e. up to 8 seconds later. PIN_EXT_VOLTAGE
+   additionally triggers a pin change interrupt, which also wakes us from
+   power down, whenever the external voltage crosses the digital input
+   threshold. The event is latched with its age and the ext_voltage shutdown
+   cause follows the level immediately, the Raspberry is notified by the next
+   loop (see notify_host()). The age counts in seconds of the watchdog.
+   The interrupt is shared with the button, a change of the latched level
+   tells them apart.
+*/
+Power_Event power_event = { 0, 0, 0xFFFF };
+
+void init_power_monitor() {
+  power_event.present = (PINB & bit(PIN_EXT_VOLTAGE)) ? 1 : 0;
+  if (!power_event.present) {
+    should_shutdown |= Shutdown_Cause::ext_voltage;
+  }
+
+  PCMSK |= bit(PIN_EXT_VOLTAGE);    // set interrupt pin
+  GIMSK |= bit(PCIE);               // enable pin change interrupts
+}
+
+/*
+   Latch a change of the external voltage, returns true if the level of
+   PIN_EXT_VOLTAGE differs from the latched one. Called from the pin change
+   interrupt with interrupts disabled.
+*/
+bool check_power() {
+  uint8_t present = (PINB & bit(PIN_EXT_VOLTAGE)) ? 1 : 0;
+  if (present == power_event.present) {
+    return false;
+  }
+  power_event.present = present;
+  power_event.events++;
+  power_event.age = 0;
+
+  if (present) {
+    should_shutdown &= ~Shutdown_Cause::ext_voltage;
+  } else {
+    if (should_shutdown != Shutdown_Cause::rpi_initiated) {
+      should_shutdown |= Shutdown_Cause::ext_voltage;
+    }
+    // the voltage before the loss, the one after is measured by the main loop
+    power_loss_raw = bat_raw;
+  }
+  return true;
+}
+
+/*
+   Clear the shutdown causes once a shutdown has been handled. The
+   ext_voltage cause is kept while the external voltage is missing, otherwise
+   the Raspberry would never hear about the loss. Interrupts are disabled.
+*/
+void clear_shutdown_causes() {
+  check_power();
+  should_shutdown = power_event.present ? Shutdown_Cause::none : Shutdown_Cause::ext_voltage;
+}
+
+/*
+   Catch a change the interrupt has missed, e.g. when the LED functions
+   cleared the interrupt flag
+*/
+void poll_power() {
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    check_power();
+  }
+}
+
+/*
+   Called with the seconds slept (see reset_watchdog()), interrupts are disabled
+*/
+void advance_power_event(uint8_t elapsed) {
+  if (power_event.age <= 0xFFFF - elapsed) {
+    power_event.age += elapsed;
+  } else {
+    power_event.age = 0xFFFF;
+  }
+}
+
+void write_power_event() {
+  write_data_crc((uint8_t *)&power_event, sizeof(power_event));
+}
+
 /*
    The following two methods switch the PIN_SWITCH to high and low,
    respectively. The high state is implemented using the pullup resistor
@@ -116,10 +200,12 @@ boolean ups_check_voltage() {
    2    pull the switch pin low to turn the UPS off (reset needs 1 pulse)
    3    turn switch off and on to turn the UPS off/on (2 pulses, check for external voltage)
 
-   Additionally, should_shutdown is cleared.
+   Additionally, should_shutdown is cleared (see clear_shutdown_causes()).
 */
 void restart_raspberry() {
-  should_shutdown = 0;
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    clear_shutdown_causes();
+  }
 
   ups_off();
   delay(switch_recovery_delay); // wait for the switch circuit to revover
@@ -133,11 +219,15 @@ void push_switch(uint16_t pulse_time) {
 }
 
 void ups_off() {
+  measure_precisely();
+  uint16_t before = measure_bat_millivolts();
+
   if (ups_is_voltage_controlled()) {
     switch_pin_low();
   } else {
     if (ups_check_voltage()) {
       read_voltages();
+      update_millivolts();
 
       if (ext_voltage < MIN_POWER_LEVEL) {
         // the external voltage is off i.e., the Pi is already turned off.
@@ -146,14 +236,19 @@ void ups_off() {
     }
     push_switch(reset_pulse_length);
   }
+  record_load_step(Load_Step_Kind::ups_off, before);
 }
 
 void ups_on() {
+  measure_precisely();
+  uint16_t before = measure_bat_millivolts();
+
   if (ups_is_voltage_controlled()) {
     switch_pin_high();
   } else {
     if (ups_check_voltage()) {
       read_voltages();
+      update_millivolts();
 
       if (ext_voltage > MIN_POWER_LEVEL) {
         // the external voltage is present i.e., the Pi has already been turned on.
@@ -162,4 +257,5 @@ void ups_on() {
     }
     push_switch(reset_pulse_length);
   }
+  record_load_step(Load_Step_Kind::ups_on, before);
 }
@@ -0,0 +1,367 @@
+/*
+   The register table describes every register that is backed by a variable:
+   its number, size, signedness, whether it can be written, the variable holding
+   it, the EEPROM slot it is persisted in and a hook that is executed after it
+   has been written. Both I2C callbacks use this table instead of handling each
+   register on its own, so adding a register means adding a row here.
+
+   The rows have to be sorted by register number and the registers of a block
+   (same high nibble) have to be contiguous, this allows find_register() to
+   locate a row in constant time using register_index.
+*/
+const uint8_t WRITABLE = Register_Flag::writable;
+const uint8_t SIGNED   = Register_Flag::is_signed;
+
+const Register_Descriptor register_table[] PROGMEM = {
+  // register                         size and flags         variable                    EEPROM slot                                hook
+  { Register::last_access,             2,                     &seconds,                   EEPROM_Address::none,                      Register_Hook::none },
+  { Register::bat_voltage,             2,                     &bat_voltage,               EEPROM_Address::none,                      Register_Hook::none },
+  { Register::ext_voltage,             2,                     &ext_voltage,               EEPROM_Address::none,                      Register_Hook::none },
+  { Register::bat_voltage_coefficient, 2 | WRITABLE,          &bat_voltage_coefficient,   EEPROM_Address::bat_voltage_coefficient,   Register_Hook::reset_bat_average },
+  { Register::bat_voltage_constant,    2 | WRITABLE | SIGNED, &bat_voltage_constant,      EEPROM_Address::bat_voltage_constant,      Register_Hook::reset_bat_average },
+  { Register::ext_voltage_coefficient, 2 | WRITABLE,          &ext_voltage_coefficient,   EEPROM_Address::ext_voltage_coefficient,   Register_Hook::calibration },
+  { Register::ext_voltage_constant,    2 | WRITABLE | SIGNED, &ext_voltage_constant,      EEPROM_Address::ext_voltage_constant,      Register_Hook::calibration },
+  { Register::oversampling,            1 | WRITABLE,          &oversampling,              EEPROM_Address::oversampling,              Register_Hook::none },
+  { Register::state_of_charge,         1,                     &state_of_charge,           EEPROM_Address::none,                      Register_Hook::none },
+  { Register::timeout,                 1 | WRITABLE,          &timeout,                   EEPROM_Address::timeout,                   Register_Hook::none },
+  { Register::primed,                  1 | WRITABLE,          &primed,                    EEPROM_Address::primed,                    Register_Hook::none },
+  { Register::should_shutdown,         1 | WRITABLE,          &should_shutdown,           EEPROM_Address::none,                      Register_Hook::none },
+  { Register::force_shutdown,          1 | WRITABLE,          &force_shutdown,            EEPROM_Address::force_shutdown,            Register_Hook::none },
+  { Register::led_off_mode,            1 | WRITABLE,          &led_off_mode,              EEPROM_Address::led_off_mode,              Register_Hook::none },
+  { Register::notify,                  1 | WRITABLE,          &notify,                    EEPROM_Address::notify,                    Register_Hook::none },
+  { Register::restart_voltage,         2 | WRITABLE,          &restart_voltage,           EEPROM_Address::restart_voltage,           Register_Hook::thresholds },
+  { Register::warn_voltage,            2 | WRITABLE,          &warn_voltage,              EEPROM_Address::warn_voltage,              Register_Hook::thresholds },
+  { Register::shutdown_voltage,        2 | WRITABLE,          &shutdown_voltage,          EEPROM_Address::shutdown_voltage,          Register_Hook::thresholds },
+  { Register::time_to_warn,            2,                     &time_to_warn,              EEPROM_Address::none,                      Register_Hook::none },
+  { Register::time_to_shutdown,        2,                     &time_to_shutdown,          EEPROM_Address::none,                      Register_Hook::none },
+  { Register::temperature,             2 | SIGNED,            &temperature,               EEPROM_Address::none,                      Register_Hook::none },
+  { Register::temperature_coefficient, 2 | WRITABLE,          &temperature_coefficient,   EEPROM_Address::temperature_coefficient,   Register_Hook::calibration },
+  { Register::temperature_constant,    2 | WRITABLE | SIGNED, &temperature_constant,      EEPROM_Address::temperature_constant,      Register_Hook::calibration },
+  { Register::reset_configuration,     1 | WRITABLE,          &reset_configuration,       EEPROM_Address::reset_configuration,       Register_Hook::none },
+  { Register::reset_pulse_length,      2 | WRITABLE,          &reset_pulse_length,        EEPROM_Address::reset_pulse_length,        Register_Hook::none },
+  { Register::switch_recovery_delay,   2 | WRITABLE,          &switch_recovery_delay,     EEPROM_Address::switch_recovery_delay,     Register_Hook::none },
+  { Register::bat_process_noise,       2 | WRITABLE,          &bat_process_noise,         EEPROM_Address::bat_process_noise,         Register_Hook::none },
+  { Register::bat_measurement_noise,   2 | WRITABLE,          &bat_measurement_noise,     EEPROM_Address::bat_measurement_noise,     Register_Hook::none },
+  { Register::temperature_alpha,       1 | WRITABLE,          &temperature_alpha,         EEPROM_Address::temperature_alpha,         Register_Hook::none },
+  { Register::sampling_profile,        1 | WRITABLE,          &sampling_profile,          EEPROM_Address::sampling_profile,          Register_Hook::none },
+  { Register::sag_reference,           2 | WRITABLE,          &sag_reference,             EEPROM_Address::sag_reference,             Register_Hook::battery_health },
+  { Register::sag_average,             2,                     &sag_average,               EEPROM_Address::sag_average,               Register_Hook::none },
+  { Register::battery_health,          1,                     &battery_health,            EEPROM_Address::none,                      Register_Hook::none },
+  { Register::version,                 4,                     (void *)&prog_version,      EEPROM_Address::none,                      Register_Hook::none },
+  { Register::fuse_low,                1,                     &fuse_low,                  EEPROM_Address::none,                      Register_Hook::none },
+  { Register::fuse_high,               1,                     &fuse_high,                 EEPROM_Address::none,                      Register_Hook::none },
+  { Register::fuse_extended,           1,                     &fuse_extended,             EEPROM_Address::none,                      Register_Hook::none },
+  { Register::internal_state,          1,                     &state,                     EEPROM_Address::none,                      Register_Hook::none },
+  { Register::eeprom_pending,          1,                     (void *)&eeprom_pending,    EEPROM_Address::none,                      Register_Hook::none },
+  { Register::i2c_address,             2 | WRITABLE,          &i2c_address,               EEPROM_Address::i2c_address,               Register_Hook::i2c_address },
+  { Register::init_eeprom,             1 | WRITABLE,          nullptr,                    EEPROM_Address::none,                      Register_Hook::init_eeprom },
+};
+
+const uint8_t NUM_REGISTERS = sizeof(register_table) / sizeof(register_table[0]);
+static_assert(sizeof(register_table) / sizeof(register_table[0]) <= MAX_REGISTERS, "register table too large for the bitmaps");
+
+/*
+   For each block (high nibble of the register number) this holds the row of the
+   register with low nibble 0, i.e. the row of register r is register_index[r >> 4] + (r & 0xF).
+   The value can be "virtual" (before the first row) if a block starts with a low
+   nibble > 0, the unsigned overflow takes care of this. Blocks without any register
+   point behind the table. It is filled once in init_registers().
+*/
+uint8_t register_index[16];
+
+/*
+   The change bitmap holds one bit per row of the register table. A bit is set
+   when the register is written (over I2C or by ourselves, see track_changes())
+   and all bits are set after a reset. The Raspberry reads and clears the bitmap
+   with a single read of the changed register and only has to fetch the
+   registers that are marked. The measurements (voltages, state of charge,
+   predicted times, temperature, last_access, eeprom_pending) change all the
+   time and are not tracked.
+*/
+volatile uint8_t register_changed[MAX_REGISTERS / 8];
+
+void init_registers() {
+  for (uint8_t i = 0; i < 16; i++) {
+    register_index[i] = 0x80;                // behind the table, find_register() will fail
+  }
+  for (uint8_t row = 0; row < NUM_REGISTERS; row++) {
+    register_changed[row >> 3] |= bit(row & 0x7);
+  }
+  // iterate backwards so that the first row of each block wins
+  Register_Descriptor descriptor;
+  for (uint8_t row = NUM_REGISTERS; row-- > 0; ) {
+    read_descriptor(row, descriptor);
+    uint8_t reg = static_cast<uint8_t>(descriptor.reg);
+    register_index[reg >> 4] = row - (reg & 0xF);
+  }
+}
+
+/*
+   Copy a row of the register table from flash. Returns false if row is behind
+   the end of the table, this allows other modules to iterate over the table.
+*/
+bool read_descriptor(uint8_t row, Register_Descriptor &descriptor) {
+  if (row >= NUM_REGISTERS) {
+    return false;
+  }
+  memcpy_P(&descriptor, &register_table[row], sizeof(descriptor));
+  return true;
+}
+
+/*
+   Find the row of a register in constant time. Returns the row or NO_ROW if
+   the register is not in the table.
+*/
+uint8_t find_register(Register reg, Register_Descriptor &descriptor) {
+  uint8_t row = register_index[static_cast<uint8_t>(reg) >> 4] + (static_cast<uint8_t>(reg) & 0xF);
+
+  if (read_descriptor(row, descriptor) && descriptor.reg == reg) {
+    return row;
+  }
+  return NO_ROW;
+}
+
+/*
+   Map a register to the variable holding its value. Returns the address of
+   the variable and sets size to its length, or returns nullptr if the register
+   cannot be read.
+*/
+uint8_t *register_data(Register reg, uint8_t &size) {
+  Register_Descriptor descriptor;
+
+  if (find_register(reg, descriptor) == NO_ROW) {
+    return nullptr;
+  }
+  size = descriptor.flags & Register_Flag::size_mask;
+  return (uint8_t *)descriptor.data;
+}
+
+/*
+   Check that a register can be written over I2C with len bytes of data.
+   Returns Write_Result::applied and sets row if it can, the reason why not
+   otherwise.
+*/
+uint8_t check_write(Register reg, Register_Descriptor &descriptor, uint8_t &row, uint8_t len) {
+  row = find_register(reg, descriptor);
+
+  if (row == NO_ROW) {
+    return Write_Result::unknown_register;
+  }
+  if (!(descriptor.flags & Register_Flag::writable)) {
+    return Write_Result::read_only;
+  }
+  if ((descriptor.flags & Register_Flag::size_mask) > len) {
+    return Write_Result::wrong_size;
+  }
+  return Write_Result::applied;
+}
+
+/*
+   Write len bytes of data received over I2C to a register. Writes to unknown
+   or read-only registers, writes with the wrong size and invalid values are
+   ignored, the Write_Result tells why. This is called from receive_event(),
+   i.e. with interrupts disabled, so the variable is updated atomically.
+*/
+uint8_t write_register(Register reg, const uint8_t *value, uint8_t len) {
+  Register_Descriptor descriptor;
+  uint8_t row;
+  uint8_t result = check_write(reg, descriptor, row, len);
+
+  if (result != Write_Result::applied) {
+    return result;
+  }
+  if ((descriptor.flags & Register_Flag::size_mask) != len) {
+    return Write_Result::wrong_size;
+  }
+  if (!valid_value(descriptor, value)) {
+    return Write_Result::out_of_range;
+  }
+  apply_write(row, descriptor, value);
+  return Write_Result::applied;
+}
+
+/*
+   Write several registers at once. The frame holds the number of registers
+   followed by each register number and its value (sized as given in the
+   register table). The frame is checked completely before the first register
+   is changed, so either all registers are written or none. Since we are called
+   from receive_event() the main loop never sees a partially applied batch
+   (e.g., new warn_voltage but old shutdown_voltage), and all persisted values
+   are committed to the EEPROM together. Returns the Write_Result of the first
+   entry that has been rejected, or Write_Result::applied.
+*/
+uint8_t write_batch(const uint8_t *frame, uint8_t len) {
+  Register_Descriptor descriptor;
+  uint8_t row;
+  uint8_t count = frame[0];
+  uint8_t pos = 1;
+
+  for (uint8_t i = 0; i < count; i++) {
+    if (pos >= len) {
+      return Write_Result::wrong_size;
+    }
+    uint8_t result = check_write(static_cast<Register>(frame[pos]), descriptor, row, len - pos - 1);
+    if (result != Write_Result::applied) {
+      return result;
+    }
+    if (!valid_value(descriptor, frame + pos + 1)) {
+      return Write_Result::out_of_range;
+    }
+    pos += 1 + (descriptor.flags & Register_Flag::size_mask);
+  }
+  if (pos != len) {
+    return Write_Result::wrong_size;
+  }
+
+  pos = 1;
+  for (uint8_t i = 0; i < count; i++) {
+    row = find_register(static_cast<Register>(frame[pos]), descriptor);
+    apply_write(row, descriptor, frame + pos + 1);
+    pos += 1 + (descriptor.flags & Register_Flag::size_mask);
+  }
+  return Write_Result::applied;
+}
+
+/*
+   Check a value before it is written. Most registers accept any value, the
+   I2C address is guarded since a wrong value makes us unreachable and the
+   oversampling register only uses 6 bits. The values read from the EEPROM
+   are checked as well, an EEPROM written by an older version holds 0xFF in
+   slots it did not know.
+*/
+bool valid_value(const Register_Descriptor &descriptor, const uint8_t *value) {
+  if (descriptor.hook == Register_Hook::i2c_address) {
+    return valid_I2C_address(value);
+  }
+  if (descriptor.reg == Register::oversampling) {
+    return (value[0] & ~OVERSAMPLING_MASK) == 0;
+  }
+  if (descriptor.reg == Register::sampling_profile) {
+    return value[0] <= Sampling_Profile::adaptive;
+  }
+  // 0 would freeze the filter, all bits set is an erased EEPROM cell
+  if (descriptor.reg == Register::temperature_alpha) {
+    return value[0] != 0 && value[0] != 0xFF;
+  }
+  // all bits set is an erased EEPROM cell
+  if (descriptor.reg == Register::sag_reference || descriptor.reg == Register::sag_average) {
+    return (value[0] & value[1]) != 0xFF;
+  }
+  if (descriptor.reg == Register::bat_process_noise || descriptor.reg == Register::bat_measurement_noise) {
+    uint16_t noise = value[0] | (value[1] << 8);
+    return noise != 0xFFFF && (noise != 0 || descriptor.reg == Register::bat_measurement_noise);
+  }
+  return true;
+}
+
+/*
+   Store a value in the variable of a register and execute its hook. Persisted
+   registers are only marked for the EEPROM writer, the slow EEPROM access
+   happens later outside of the I2C callback.
+*/
+void apply_write(uint8_t row, const Register_Descriptor &descriptor, const uint8_t *value) {
+  mark_changed(row);
+  if (descriptor.data != nullptr) {
+    memcpy(descriptor.data, value, descriptor.flags & Register_Flag::size_mask);
+    if (descriptor.eeprom != EEPROM_Address::none) {
+      schedule_EEPROM_write(row);
+    }
+  }
+
+  switch (descriptor.hook) {
+    case Register_Hook::reset_bat_average:
+      bat_raw = 0;  // reset bat_voltage average
+      // the thresholds depend on the calibration
+      thresholds_stale = true;
+      calibration_stale = true;
+      break;
+    case Register_Hook::calibration:
+      calibration_stale = true;
+      break;
+    case Register_Hook::thresholds:
+      thresholds_stale = true;
+      break;
+    case Register_Hook::battery_health:
+      health_stale = true;
+      break;
+    case Register_Hook::init_eeprom:
+      if (value[0] != 0) {
+        schedule_EEPROM_rewrite();
+      }
+      break;
+    case Register_Hook::i2c_address:
+      change_I2C_address();
+      break;
+  }
+}
+
+/*
+   Mark a row of the register table as changed
+*/
+void mark_changed(uint8_t row) {
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    register_changed[row >> 3] |= bit(row & 0x7);
+  }
+}
+
+/*
+   Mark a register as changed, unknown registers are ignored
+*/
+void mark_register_changed(Register reg) {
+  Register_Descriptor descriptor;
+  uint8_t row = find_register(reg, descriptor);
+
+  if (row != NO_ROW) {
+    mark_changed(row);
+  }
+}
+
+/*
+   Mark a persisted register we have changed ourselves as changed and write it
+   to the EEPROM, unknown registers are ignored
+*/
+void persist_register(Register reg) {
+  Register_Descriptor descriptor;
+  uint8_t row = find_register(reg, descriptor);
+
+  if (row != NO_ROW) {
+    mark_changed(row);
+    schedule_EEPROM_write(row);
+  }
+}
+
+/*
+   The registers we change ourselves are changed in a lot of places (and in
+   the button interrupt), so instead of marking them at each of these places we
+   compare them once per loop with the values we have seen before.
+*/
+void track_changes() {
+  static State last_state = State::unclear_state;
+  static uint8_t last_should_shutdown = Shutdown_Cause::none;
+  static uint8_t last_primed = 0;
+
+  if (state != last_state) {
+    last_state = state;
+    mark_register_changed(Register::internal_state);
+  }
+  if (should_shutdown != last_should_shutdown) {
+    last_should_shutdown = should_shutdown;
+    mark_register_changed(Register::should_shutdown);
+  }
+  if (primed != last_primed) {
+    last_primed = primed;
+    mark_register_changed(Register::primed);
+  }
+}
+
+/*
+   Copy the change bitmap to buffer and clear it. This is called from
+   request_event(), i.e. with interrupts disabled, so no change is lost
+   between copying and clearing.
+*/
+void take_changed(uint8_t *buffer) {
+  for (uint8_t i = 0; i < MAX_REGISTERS / 8; i++) {
+    buffer[i] = register_changed[i];
+    register_changed[i] = 0;
+  }
+}
@@ -0,0 +1,76 @@
+/*
+   Adaptive sampling. Measuring the voltages is the longest part of a wake:
+   up to 65 conversions of 104us per channel plus the settling of the band gap
+   reference. While the battery voltage is stable or rising (e.g., on mains
+   power) the adaptive profile measures only every CALM_SAMPLE_INTERVAL
+   seconds with CALM_MEASUREMENTS conversions and without oversampling. As soon
+   as the battery is discharged under load or its voltage is near the warn
+   voltage, every wake measures with full precision, and the warn state wakes
+   every second instead of every 2 seconds (see reset_watchdog()).
+   The slope is the change of the filtered band gap reading over SLOPE_WINDOW
+   seconds. The reading rises when the voltage falls, so a rise of more than
+   SLOPE_DISCHARGE means discharge. Only the measurements of the state machine
+   are adapted, the checks of ups_on() and ups_off() always measure precisely.
+*/
+bool calm_measurement = false;            // the next measurement may use few conversions
+bool discharging = true;                  // the battery voltage falls, assumed until we know better
+uint8_t sample_elapsed = 0;               // seconds since the last measurement
+uint8_t slope_elapsed = 0;                // seconds since slope_reference has been taken
+uint16_t slope_reference = 0;             // the band gap reading at the start of the slope window
+
+/*
+   Called with the seconds slept (see reset_watchdog()), the counters only have
+   to reach their interval.
+*/
+void advance_sampling(uint8_t elapsed) {
+  if (sample_elapsed < CALM_SAMPLE_INTERVAL) {
+    sample_elapsed += elapsed;
+  }
+  if (slope_elapsed < SLOPE_WINDOW) {
+    slope_elapsed += elapsed;
+  }
+}
+
+/*
+   Decide whether the state machine measures in this wake
+*/
+bool measurement_due() {
+  calm_measurement = sampling_profile == Sampling_Profile::adaptive
+                     && state == State::running_state
+                     && !discharging
+                     && !bat_voltage_at_or_below(warn_raw - (warn_raw >> WARN_MARGIN_SHIFT));
+
+  return !calm_measurement || sample_elapsed >= CALM_SAMPLE_INTERVAL;
+}
+
+/*
+   Called by ups_on() and ups_off() before they measure, the wake may have
+   been found calm by measurement_due()
+*/
+void measure_precisely() {
+  calm_measurement = false;
+}
+
+/*
+   Called after each measurement of the state machine, takes the slope
+*/
+void sampled() {
+  calm_measurement = false;
+  sample_elapsed = 0;
+
+  if (slope_reference == 0) {
+    slope_reference = bat_raw;
+    slope_elapsed = 0;
+  } else if (slope_elapsed >= SLOPE_WINDOW) {
+    discharging = (int16_t)(bat_raw - slope_reference) > (int16_t)SLOPE_DISCHARGE;
+    slope_reference = bat_raw;
+    slope_elapsed = 0;
+  }
+}
+
+/*
+   True if the warn state should wake every second
+*/
+bool sampling_fast() {
+  return sampling_profile == Sampling_Profile::adaptive && discharging;
+}
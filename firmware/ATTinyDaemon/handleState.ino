@@ -30,9 +30,10 @@ void handle_state() {
   voltage_dependent_state_change();
 
   // If the button has been pressed or the bat_voltage is lower than the warn voltage
-  // we blink the LED 5 times to signal that the RPi should shut down
+  // we blink the LED 5 times to signal that the RPi should shut down. A loss of the
+  // external voltage alone is only reported, blinking on every wake would drain the battery.
   if (state <= State::warn_state) {
-    if (should_shutdown > Shutdown_Cause::rpi_initiated && (seconds < timeout)) {
+    if ((should_shutdown & ~Shutdown_Cause::ext_voltage) > Shutdown_Cause::rpi_initiated && (seconds < timeout)) {
       // RPi should take action, possibly shut down. Signal by blinking 5 times
       blink_led(5, BLINK_TIME);
     }
@@ -100,13 +101,25 @@ void act_on_state_change() {
    Change the state dependent on the freshly read battery voltage
 */
 void voltage_dependent_state_change() {
-  read_voltages();
+  if (measurement_due()) {
+    read_voltages();
+    sampled();
+    sample_runtime();
+  } else {
+    // a threshold might have been written, read_voltages() does this otherwise
+    update_thresholds();
+  }
+
+  // the first read after a silence has to get the current values as well,
+  // the conversion only happens after a measurement
+  update_millivolts();
 
-  if (bat_voltage <= shutdown_voltage) {
+  // only integer comparisons in the raw domain, see update_thresholds()
+  if (bat_voltage_at_or_below(shutdown_raw)) {
     state = State::warn_to_shutdown;
-  } else if (bat_voltage <= warn_voltage) {
+  } else if (bat_voltage_at_or_below(warn_raw)) {
     state = State::warn_state;
-  } else if (bat_voltage <= restart_voltage) {
+  } else if (bat_voltage_at_or_below(restart_raw)) {
     if (state == State::unclear_state && seconds > timeout) {
       // the RPi is not running, even after the timeout, so we assume that it
       // shut down, this means we come from a WARN_STATE or SHUTDOWN_STATE
@@ -0,0 +1,161 @@
+/*
+   Streams move data that does not fit into a register (e.g., the battery
+   voltage history or the whole EEPROM) to the Raspberry. The Raspberry selects
+   a stream and an offset by writing the stream_cursor register and then reads
+   stream_chunk repeatedly. Each chunk holds its offset, up to STREAM_CHUNK_SIZE
+   bytes of data and a CRC-16, after each chunk the cursor advances. If a chunk
+   has been received incorrectly, stream_retry sends the same chunk again
+   without moving the cursor. A chunk without data marks the end of the stream.
+   Reading the EEPROM waits for a running write, up to 3.4ms with SCL
+   stretched. While the EEPROM writer is busy a chunk of the EEPROM stream is
+   refused instead (see write_chunk()), the Raspberry asks again later.
+   The SMBus allows blocks of 32 bytes, but the USI transmit buffer only holds
+   16 bytes, this limits the size of the chunks.
+   All stream functions are called from the I2C interrupts, the cursor is thus
+   never seen half-written.
+*/
+Stream_Cursor stream_cursor = { Stream_Id::history, 0, 0 };
+uint16_t chunk_offset = 0;                // the offset of the chunk sent last
+
+/*
+   The battery voltage history is a ring of HISTORY_SIZE samples, one sample
+   is taken every HISTORY_INTERVAL seconds. The history stream starts with the
+   interval and the age of the newest sample in seconds (both uint16_t),
+   followed by the samples from oldest to newest. The position of the ring
+   and the age are frozen when the stream is selected, so a sample taken
+   while the Raspberry reads the stream does not shift the data.
+*/
+uint16_t history[HISTORY_SIZE];
+uint8_t history_next = 0;                 // the position of the next sample
+uint8_t history_count = 0;                // the number of valid samples
+uint16_t history_elapsed = 0;             // the seconds since the last sample
+volatile bool history_due = false;        // a sample is to be taken by the main loop
+
+uint8_t history_first;                    // the oldest sample when the stream was selected
+uint16_t history_header[2];               // interval and age when the stream was selected
+
+const uint8_t HISTORY_HEADER_SIZE = sizeof(history_header);
+
+/*
+   Called with the seconds slept (see reset_watchdog()), a sample of the
+   battery voltage is due whenever HISTORY_INTERVAL seconds have passed.
+   Interrupts are disabled, the conversion is left to sample_history().
+*/
+void advance_history(uint8_t elapsed) {
+  history_elapsed += elapsed;
+  if (history_elapsed >= HISTORY_INTERVAL) {
+    history_elapsed -= HISTORY_INTERVAL;
+    history_due = true;
+  }
+}
+
+/*
+   Called by the main loop, takes a due sample
+*/
+void sample_history() {
+  if (!history_due) {
+    return;
+  }
+  history_due = false;
+  update_millivolts();
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    history[history_next] = bat_voltage;
+    history_next = (history_next + 1) % HISTORY_SIZE;
+    if (history_count < HISTORY_SIZE) {
+      history_count++;
+    }
+  }
+}
+
+/*
+   Select a stream with the data written to the stream_cursor register (the
+   stream followed by the offset). Returns the Write_Result of the write.
+*/
+uint8_t open_stream(const uint8_t *data, uint8_t len) {
+  if (len != sizeof(stream_cursor.stream) + sizeof(stream_cursor.offset)) {
+    return Write_Result::wrong_size;
+  }
+  uint8_t stream = data[0];
+  uint16_t offset = data[1] | (data[2] << 8);
+  uint16_t length;
+
+  if (stream == Stream_Id::history) {
+    history_first = (history_next + HISTORY_SIZE - history_count) % HISTORY_SIZE;
+    history_header[0] = HISTORY_INTERVAL;
+    history_header[1] = history_elapsed;
+    length = HISTORY_HEADER_SIZE + history_count * sizeof(history[0]);
+  } else if (stream == Stream_Id::eeprom) {
+    length = E2END + 1;
+  } else {
+    return Write_Result::out_of_range;
+  }
+  if (offset > length) {
+    return Write_Result::out_of_range;
+  }
+  stream_cursor.stream = stream;
+  stream_cursor.offset = offset;
+  stream_cursor.length = length;
+  chunk_offset = offset;
+  return Write_Result::applied;
+}
+
+/*
+   Return the byte of the selected stream at offset
+*/
+uint8_t stream_byte(uint16_t offset) {
+  if (stream_cursor.stream == Stream_Id::eeprom) {
+    // does not wait, write_chunk() checks that no EEPROM write is running
+    return EEPROM.read(offset);
+  }
+  if (offset < HISTORY_HEADER_SIZE) {
+    return ((uint8_t *)history_header)[offset];
+  }
+  offset -= HISTORY_HEADER_SIZE;
+  uint16_t sample = history[(history_first + offset / sizeof(history[0])) % HISTORY_SIZE];
+  return offset & 1 ? sample >> 8 : sample & 0xFF;
+}
+
+/*
+   Send the chunk at offset, i.e. the offset followed by the data and the CRC-16.
+   Returns the length of the data sent, 0 for a refused chunk.
+*/
+uint8_t write_chunk(uint16_t offset) {
+  uint8_t buffer[sizeof(offset) + STREAM_CHUNK_SIZE];
+  uint8_t len = 0;
+
+  if (stream_cursor.stream == Stream_Id::eeprom && (EECR & bit(EEPE))) {
+    // STREAM_BUSY is beyond the stream, no data is read
+    offset = STREAM_BUSY;
+  }
+
+  buffer[0] = offset & 0xFF;
+  buffer[1] = offset >> 8;
+  while (len < STREAM_CHUNK_SIZE && offset + len < stream_cursor.length) {
+    buffer[sizeof(offset) + len] = stream_byte(offset + len);
+    len++;
+  }
+  write_data_crc16(buffer, sizeof(offset) + len);
+  return len;
+}
+
+/*
+   Send the cursor, i.e. stream, offset and length
+*/
+void write_stream_cursor() {
+  write_data_crc((uint8_t *)&stream_cursor, sizeof(stream_cursor));
+}
+
+/*
+   Send the next chunk and advance the cursor
+*/
+void write_stream_chunk() {
+  chunk_offset = stream_cursor.offset;
+  stream_cursor.offset += write_chunk(chunk_offset);
+}
+
+/*
+   Send the last chunk again, the cursor is not changed
+*/
+void write_stream_retry() {
+  write_chunk(chunk_offset);
+}
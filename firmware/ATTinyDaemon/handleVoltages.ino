@@ -38,9 +38,27 @@
    1111  ADC4 (Temperature)
 */
 
+/*
+   The filters of the channels (see filters.h). The battery voltage decides
+   the state, a median of 3 throws away the spikes caused by the bursty load of
+   the Raspberry and the Kalman filter smooths the rest, so the state does not
+   flap at the warn voltage. The external voltage has to follow a power loss
+   immediately and is not filtered.
+*/
+Chain<Median<3>, Kalman<bat_process_noise, bat_measurement_noise>> bat_filter;
+Pass ext_filter;
+Ema<temperature_alpha> temperature_filter;
+
+/*
+   The channels are scheduled independently, the temperature changes slowly
+   and is only measured every TEMPERATURE_INTERVAL measurements. This also
+   saves switching to the internal reference most of the time.
+*/
+uint8_t temperature_countdown = 0;        // measurements until the temperature is due
+
 void read_voltages() {
-  // if we are in shutdown state take only one measurement
-  uint8_t num_measurements = state > State::warn_state ? 1 : NUM_MEASUREMENTS; 
+  // if we are in shutdown state take only one measurement, while the battery is stable only a few
+  uint8_t num_measurements = state > State::warn_state ? 1 : calm_measurement ? CALM_MEASUREMENTS : NUM_MEASUREMENTS;
 
   /* Table 17-5 defines the prescaler values. For a clock frequency of 8MHz which we use,
      a divison factor of 64 leads to the needed sample rate of 125kHz, which is in the
@@ -51,19 +69,24 @@ void read_voltages() {
 
   //-- Measure Temperature -------------------------------------------------------------
   // temperature first because the ADC measurements heat the chip
-  // switch to ADC4 and to internal 1.1V reference to measure temperature
-  ADMUX = bit(REFS1) | bit(MUX3) | bit(MUX2) | bit(MUX1) | bit(MUX0);
+  bool temperature_due = temperature_countdown == 0;
+  uint16_t temp_temperature = 0;
+  if (temperature_due) {
+    temperature_countdown = TEMPERATURE_INTERVAL;
 
-  uint32_t temp_temperature = read_adc(num_measurements);
-  temp_temperature *= temperature_coefficient;
+    // switch to ADC4 and to internal 1.1V reference to measure temperature
+    ADMUX = bit(REFS1) | bit(MUX3) | bit(MUX2) | bit(MUX1) | bit(MUX0);
 
-  temp_temperature = temp_temperature / 1000 + temperature_constant;
+    temp_temperature = read_adc(num_measurements, oversampling_ratio(OVERSAMPLING_TEMPERATURE));
+  }
+  temperature_countdown--;
 
   //-- Measure Vcc ---------------------------------------------------------------------
   /*
     The trick to measure Vcc is to measure the band gap voltage against
     the current Vcc. Since we know that the band gap voltage is very stable
-    and around 1.1V we can calculate the current Vcc by "inverting" the result.
+    and around 1.1V we can calculate the current Vcc by "inverting" the result
+    (see bat_millivolts()).
   */
 
   // REFS2, REFS1, REFS0 == 0 selects Vcc as reference, MUX3, MUX2 == 1 selects band gap
@@ -74,15 +97,13 @@ void read_voltages() {
    After switching to internal voltage reference the ADC requires a settling time
    of 1ms before measurements are stable. Conversions starting before this may not
    be reliable. The ADC must be enabled during the settling time.
+   The band gap is off while we sleep in power down, so this is needed on every
+   wake. Instead of waiting with delay() we sleep through conversions we throw
+   away (see adc_settle()).
   */
-  delay(2); // Wait for ADC to settle
+  adc_settle();
 
-  // Calculate Vcc (in mV); 1.126.400 = 1.1*1024*1000, see Ch. 17.11.1 of datasheet
-  uint32_t temp_bat_voltage = 1126400L / read_adc(num_measurements);
-
-  // correct the measurement using coefficient and constant
-  temp_bat_voltage *= bat_voltage_coefficient;
-  temp_bat_voltage = temp_bat_voltage / 1000 + bat_voltage_constant;
+  uint16_t temp_bat_raw = read_adc(num_measurements, oversampling_ratio(OVERSAMPLING_BAT_VOLTAGE));
 
 
   //-- Measure EXT_V -------------------------------------------------------------------
@@ -90,34 +111,70 @@ void read_voltages() {
   // of the ADC we want to use directly
   ADMUX = ADC_NUMBER(EXT_VOLTAGE);
 
-  uint32_t temp_ext_voltage = read_adc(num_measurements);
-  temp_ext_voltage *= temp_bat_voltage;    // normalize relative to Vcc
-  temp_ext_voltage /= 1024;
-
-  // correct the measurement using coefficient and constant
-  if((signed)temp_ext_voltage > ext_voltage_constant) {
-    temp_ext_voltage *= ext_voltage_coefficient;
-    temp_ext_voltage = temp_ext_voltage / 1000 + ext_voltage_constant;
-  } else {
-    temp_ext_voltage = 0;
-  }
+  uint16_t temp_ext_raw = read_adc(num_measurements, oversampling_ratio(OVERSAMPLING_EXT_VOLTAGE));
 
 
   //-- Turn off the ADC ----------------------------------------------------------------
   ADCSRA &= ~bit(ADEN); // turn off the ADC
 
-  if (bat_voltage != 0) {
-    // Average battery voltage over the last few measurements.
-    // This allows us to average out short voltage spikes caused by
-    // the Raspberry's different loads.
-    temp_bat_voltage = (temp_bat_voltage + bat_voltage * 9) / 10;
-
+  vcc_raw = temp_bat_raw;
+  if (bat_raw == 0) {
+    // the first measurement or the calibration has changed, restart the filter
+    // and the prediction
+    bat_filter.reset();
+    reset_runtime();
+  } else {
     if (state == State::warn_state && should_shutdown != Shutdown_Cause::rpi_initiated) {
       should_shutdown |= Shutdown_Cause::bat_voltage;
     } else {
       should_shutdown &= ~Shutdown_Cause::bat_voltage;
     }
   }
+  bat_raw = bat_filter.apply(temp_bat_raw);
+  ext_raw = ext_filter.apply(temp_ext_raw);
+  if (temperature_due) {
+    temperature_raw = temperature_filter.apply(temp_temperature);
+  }
+  millivolts_stale = true;
+
+  update_thresholds();
+}
+
+/*
+   The calibrations as fixed-point multipliers, see update_calibration()
+*/
+Calibration bat_calibration;
+Calibration ext_calibration;
+Calibration temperature_calibration;
+
+/*
+   Convert the raw measurements to the voltage and temperature registers. The
+   divisions needed for this are too expensive for every wake, so we do this
+   only once after each measurement, not in the wakes without one (see
+   measurement_due()).
+*/
+void update_millivolts() {
+  if (!millivolts_stale) {
+    return;
+  }
+  millivolts_stale = false;
+  update_calibration();
+
+  int16_t temp_temperature = calibrate(temperature_raw, temperature_calibration);
+
+  uint16_t temp_bat_voltage = bat_millivolts(bat_raw, bat_calibration);
+
+  uint32_t temp_ext_voltage = ext_raw;
+  // normalize relative to Vcc at the time of the measurement
+  temp_ext_voltage *= bat_millivolts(vcc_raw, bat_calibration);
+  temp_ext_voltage >>= ADC_BITS;
+
+  // correct the measurement using coefficient and constant
+  if((signed)temp_ext_voltage > ext_calibration.constant) {
+    temp_ext_voltage = calibrate(temp_ext_voltage, ext_calibration);
+  } else {
+    temp_ext_voltage = 0;
+  }
 
   // we use the following block to guarantee that the values are atomically set
   // even in the presence of interrupts from I2C
@@ -126,6 +183,194 @@ void read_voltages() {
     ext_voltage = temp_ext_voltage;
     temperature = temp_temperature;
   }
+  update_state_of_charge(temp_bat_voltage, temp_temperature);
+
+  // calculate the I2C responses for the new values now instead of in request_event()
+  prepare_frames();
+}
+
+/*
+   Convert the coefficients and constants after one of them has been written
+   (see Register_Hook::calibration). The values can be changed over I2C at any
+   time, we take a consistent copy.
+*/
+void update_calibration() {
+  if (!calibration_stale) {
+    return;
+  }
+  calibration_stale = false;
+
+  uint16_t bat_coefficient;
+  uint16_t ext_coefficient;
+  uint16_t temp_coefficient;
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    bat_coefficient = bat_voltage_coefficient;
+    bat_calibration.constant = bat_voltage_constant;
+    ext_coefficient = ext_voltage_coefficient;
+    ext_calibration.constant = ext_voltage_constant;
+    temp_coefficient = temperature_coefficient;
+    temperature_calibration.constant = temperature_constant;
+  }
+
+  // the coefficients are * 1000, the temperature is measured in ADC_BITS instead of 10 bits
+  fixed_point(bat_calibration, bat_coefficient, 1000);
+  fixed_point(ext_calibration, ext_coefficient, 1000);
+  fixed_point(temperature_calibration, temp_coefficient, 1000L << (ADC_BITS - 10));
+}
+
+/*
+   Calculate multiplier and shift of coefficient / divisor by long division,
+   one bit at a time until the multiplier has 16 significant bits, and round
+   the last bit. The quotient has to be below 0x10000.
+*/
+void fixed_point(Calibration &calibration, uint16_t coefficient, uint32_t divisor) {
+  uint32_t multiplier = coefficient / divisor;
+  uint32_t remainder = coefficient % divisor;
+  uint8_t shift = 0;
+
+  while (multiplier < 0x8000 && shift < 31) {
+    multiplier <<= 1;
+    remainder <<= 1;
+    shift++;
+    if (remainder >= divisor) {
+      multiplier |= 1;
+      remainder -= divisor;
+    }
+  }
+  if (2 * remainder >= divisor) {
+    multiplier++;
+    if (multiplier > 0xFFFF) {
+      multiplier >>= 1;
+      shift--;
+    }
+  }
+  calibration.multiplier = multiplier;
+  calibration.shift = shift;
+}
+
+/*
+   value * coefficient / divisor + constant with the fixed-point multiplier
+*/
+int32_t calibrate(uint16_t value, const Calibration &calibration) {
+  uint32_t product = (uint32_t)value * calibration.multiplier;
+  return (int32_t)(product >> calibration.shift) + calibration.constant;
+}
+
+/*
+   Convert a band gap reading to the corrected battery voltage in mV.
+   1.126.400 = 1.1*1024*1000, see Ch. 17.11.1 of datasheet
+   This division is the only one left, it inverts the measurement. The
+   result is clamped to the range of the register.
+*/
+uint16_t bat_millivolts(uint16_t raw, const Calibration &calibration) {
+  if (raw == 0) {
+    return 0;
+  }
+  uint32_t millivolts = (1126400L << (ADC_BITS - 10)) / raw;
+  if (millivolts > 0xFFFF) {
+    millivolts = 0xFFFF;
+  }
+  return constrain(calibrate(millivolts, calibration), 0, 0xFFFF);
+}
+
+/*
+   Convert a band gap reading to mV with the current calibration without
+   touching the registers, for readings other than the converted one (see
+   update_millivolts()).
+*/
+uint16_t calibrated_bat_millivolts(uint16_t raw) {
+  update_calibration();
+  return bat_millivolts(raw, bat_calibration);
+}
+
+/*
+   A single unfiltered measurement of the battery voltage in mV, the filters
+   would smooth away the load steps (see handleBattery.ino). Does not touch the
+   readings of read_voltages().
+*/
+uint16_t measure_bat_millivolts() {
+  ADCSRA = bit(ADEN) | bit(ADPS2) | bit(ADPS1);
+  ADMUX = bit(MUX3) | bit(MUX2);
+  adc_settle();
+  uint16_t raw = read_adc(NUM_MEASUREMENTS, 0);
+  ADCSRA &= ~bit(ADEN);
+
+  return calibrated_bat_millivolts(raw);
+}
+
+/*
+   Compare the averaged battery voltage with a threshold in the raw domain. The
+   band gap reading rises when the voltage drops. Without a measurement
+   (bat_raw == 0) we are below every threshold.
+*/
+bool bat_voltage_at_or_below(uint16_t threshold_raw) {
+  return bat_raw == 0 || bat_raw >= threshold_raw;
+}
+
+/*
+   Convert a battery voltage threshold to the raw domain, i.e. the smallest
+   reading for which bat_millivolts() is at or below millivolts. The
+   conversion falls with the reading, a binary search with the conversion
+   itself guarantees that the comparison in the raw domain gives the same
+   result as the one in mV. 0xFFFF is never reached by a reading.
+*/
+uint16_t raw_threshold(uint16_t millivolts, const Calibration &calibration) {
+  uint16_t low = 1;
+  uint16_t high = 0xFFFF;
+
+  while (low < high) {
+    uint16_t middle = low + (high - low) / 2;
+    if (bat_millivolts(middle, calibration) <= millivolts) {
+      high = middle;
+    } else {
+      low = middle + 1;
+    }
+  }
+  return high;
+}
+
+/*
+   Convert the thresholds after one of them or the calibration of the battery
+   voltage has been written (see Register_Hook::thresholds). The values can be
+   changed over I2C at any time, we take a consistent copy.
+*/
+void update_thresholds() {
+  if (!thresholds_stale) {
+    return;
+  }
+  thresholds_stale = false;
+  update_calibration();
+
+  uint16_t current_shutdown_voltage;
+  uint16_t current_warn_voltage;
+  uint16_t current_restart_voltage;
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    current_shutdown_voltage = shutdown_voltage;
+    current_warn_voltage = warn_voltage;
+    current_restart_voltage = restart_voltage;
+  }
+
+  shutdown_raw = raw_threshold(current_shutdown_voltage, bat_calibration);
+  warn_raw = raw_threshold(current_warn_voltage, bat_calibration);
+  restart_raw = raw_threshold(current_restart_voltage, bat_calibration);
+}
+
+/*
+   The oversampling ratio of a channel, budgeted by state: in the warn state
+   it is limited to OVERSAMPLING_WARN_MAX, beyond it (i.e., when shutting down)
+   and while the battery is stable (see handleSampling.ino) we do not oversample
+   at all.
+*/
+uint8_t oversampling_ratio(uint8_t channel) {
+  uint8_t ratio = (oversampling >> channel) & OVERSAMPLING_MAX;
+
+  if (state > State::warn_state || calm_measurement) {
+    return 0;
+  }
+  if (state == State::warn_state && ratio > OVERSAMPLING_WARN_MAX) {
+    return OVERSAMPLING_WARN_MAX;
+  }
+  return ratio;
 }
 
 /*
@@ -133,16 +378,29 @@ void read_voltages() {
    lowest and averages the rest. If num_measurements is < 4, we simply average
    all measured values. This allows to get a more precise measurement.
    In addition a the first, extra measurement is always thrown away
+   With an oversampling ratio > 0, 4^ratio measurements are taken instead and
+   their sum is decimated by ratio bits. Nothing is thrown away here except the
+   first measurement, the noise of the single measurements is what gives us the
+   additional resolution.
+   The result is scaled to ADC_BITS bits in both cases.
 */
-uint32_t read_adc(uint8_t num_measurements) {
+uint16_t read_adc(uint8_t num_measurements, uint8_t ratio) {
 
   uint32_t result = 0;
   uint16_t highest_val = 0;
   uint16_t lowest_val = USHRT_MAX;
 
+  if (ratio > 0) {
+    num_measurements = 1 << (2 * ratio);
+  }
+
+  // the ADC complete interrupt wakes us from the ADC noise reduction sleep
+  ADCSRA |= bit(ADIE);
+
   // measure num_measurements + 1 times and throw away first measurement
   for (int i = 0; i <= num_measurements; i++) {
-    ADCSRA |= bit(ADSC); // Start conversion
+    adc_sleep();
+    // another interrupt (e.g., I2C) might have woken us, the conversion continues
     loop_until_bit_is_clear(ADCSRA, ADSC); // wait for results
 
     uint8_t low  = ADCL; // must read ADCL first - it then locks ADCH
@@ -159,11 +417,51 @@ uint32_t read_adc(uint8_t num_measurements) {
       }
     }
   }
-  if (num_measurements > 3) {
+  ADCSRA &= ~bit(ADIE);
+
+  if (ratio > 0) {
+    result >>= ratio;
+  } else if (num_measurements > 3) {
     result = (result - highest_val - lowest_val) / (num_measurements - 2);
   } else {
     result /= num_measurements;
   }
 
-  return result;  // 32 bit forces correct calculation of voltages in the next step
+  return result << (ADC_BITS - 10 - ratio);
+}
+
+/*
+   Let the input of the ADC settle for at least 1ms. The conversions run in
+   the ADC noise reduction mode, i.e. the CPU sleeps instead of busy waiting
+   in delay(). The first conversion after enabling the ADC takes 25 ADC clock
+   cycles, the others 13, at 125kHz SETTLE_CONVERSIONS take about 1.1ms.
+*/
+void adc_settle() {
+  ADCSRA |= bit(ADIE);
+  for (uint8_t i = 0; i < SETTLE_CONVERSIONS; i++) {
+    adc_sleep();
+    loop_until_bit_is_clear(ADCSRA, ADSC);
+  }
+  ADCSRA &= ~bit(ADIE);
+}
+
+/*
+   Run a single conversion in the ADC noise reduction mode (data sheet ch. 7.1.2,
+   p. 34). The CPU and the I/O clock are halted, entering the sleep mode starts
+   the conversion and the ADC complete interrupt wakes us again. This saves the
+   energy of busy waiting and keeps the switching noise of the CPU away from the
+   measurement. The sequence follows handle_sleep(), interrupts() guarantees that
+   sleep_cpu() is executed before any interrupt, the conversion starts only when
+   we are asleep so its interrupt cannot be missed.
+*/
+void adc_sleep() {
+  set_sleep_mode(SLEEP_MODE_ADC);
+  noInterrupts();
+  sleep_enable();
+  interrupts();
+  sleep_cpu();
+  sleep_disable();
 }
+
+// ADC complete interrupt, it only has to wake us
+EMPTY_INTERRUPT(ADC_vect);
@@ -3,27 +3,48 @@
  * We use the watchdog to wake us from deep sleep. The length of the
  * deep sleep depends on the current battery voltage. If above 
  * warn_voltage, we wake every second, if between shutdown_voltage and
- * warn_voltage, we wake very 2 seconds, and if we are below shutdown_voltage
+ * warn_voltage, we wake very 2 seconds (every second if the battery is
+ * discharged under load), and if we are below shutdown_voltage
  * we only wake every 8 seconds. Our seconds counter is changed accordingly.
+ * Other interrupts (I2C, the external voltage, the EEPROM) wake us as well,
+ * the time base only advances when the watchdog has fired (see WDT_vect),
+ * after any other wake the running watchdog is left alone. Changing the
+ * period restarts it, the part of the old period already slept is lost.
  */
+volatile bool watchdog_fired = false;     // set by the watchdog interrupt
+uint8_t watchdog_period = 0;              // the seconds of the running watchdog, 0 before the first start
+
 void reset_watchdog () {
   uint8_t wd_value;
+  uint8_t period;
 
-  if (bat_voltage <= shutdown_voltage) {
-    // either startup or low power (includes bat_voltage == 0)
+  if (bat_voltage_at_or_below(shutdown_raw)) {
+    // either startup or low power (includes bat_raw == 0)
     // If we are starting then this gives us enough time to
     // initialize everything without any problems    
     wd_value = bit (WDIE) | bit (WDP3) | bit (WDP0);                 // set WDIE, and 8 seconds delay
-    seconds += 8;
-  } else if (bat_voltage <= warn_voltage) {
+    period = 8;
+  } else if (bat_voltage_at_or_below(warn_raw) && !sampling_fast()) {
     // warn_voltage, we reduce signalling to every 2 seconds
     wd_value = bit (WDIE) | bit (WDP2) | bit (WDP1) | bit (WDP0);    // set WDIE, and 2 second delay
-    seconds += 2;
+    period = 2;
   } else {
-    // everything ok, we signal every second
+    // everything ok (or discharging in the warn state, see sampling_fast()), we signal every second
     wd_value = bit (WDIE) | bit (WDP2) | bit (WDP1);                 // set WDIE, and 1 second delay
-    seconds += 1;
+    period = 1;
+  }
+  if (watchdog_fired) {
+    watchdog_fired = false;
+    seconds += watchdog_period;
+    advance_history(watchdog_period);
+    advance_sampling(watchdog_period);
+    advance_power_event(watchdog_period);
+    advance_runtime(watchdog_period);
+  } else if (period == watchdog_period) {
+    // woken by another interrupt, the watchdog keeps running
+    return;
   }
+  watchdog_period = period;
 
   // clear various "reset" flags
   MCUSR = 0;
@@ -39,4 +60,5 @@ void reset_watchdog () {
 // watchdog interrupt
 ISR (WDT_vect) {
   wdt_disable();  // disable watchdog
+  watchdog_fired = true;
 }